@@ -0,0 +1,157 @@
+#pragma once
+
+#include "includes.h"
+#include "node.h"
+#include "profiler.h"
+#include "settings.h"
+#include "utils.h"
+
+#include <condition_variable>
+#include <mutex>
+
+// Draws a shape on its own thread, so input is never blocked by a frame.
+//
+// Transforms queued while a frame is drawn are merged into one update. They
+// all commute, since Node keeps position, orientation and scale apart. The
+// thread always draws the newest state into the back buffer of its render
+// target and swaps it with the front buffer when done. Intermediate states
+// are never drawn, and a finished frame that was not presented before the
+// next swap is dropped.
+class async_renderer {
+public:
+  // The shape and light belong to the render thread until finish()
+  explicit async_renderer(Shape &shape, const Light *light = nullptr)
+      : shape(shape), light(light),
+        front(HEIGHT, WIDTH, CV_8UC3, (cv::Scalar)BACKGROUND_COLOR) {
+    pending.redraw = true; // Initial frame
+    worker = std::thread([this]() { run(); });
+  }
+
+  ~async_renderer() { stop(); }
+
+  async_renderer(const async_renderer &) = delete;
+  async_renderer &operator=(const async_renderer &) = delete;
+
+  void translate(float x, float y, float z) {
+    queue([&](update &u) { u.move += cv::Point3f(x, y, z); });
+  }
+  void rotate(float angle, cv::Vec3f axis) {
+    queue([&](update &u) {
+      u.turn = u.turn * utils::quat::from_axis_angle(angle, axis);
+    });
+  }
+  void scale(float x, float y, float z) {
+    queue([&](update &u) {
+      u.stretch = cv::Vec3f(u.stretch[0] * x, u.stretch[1] * y,
+                            u.stretch[2] * z);
+    });
+  }
+
+  // Calls show(frame) with the front buffer if a frame was finished since
+  // the last call. The buffer is not swapped while `show` runs
+  template <typename Show> bool present(Show show) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!fresh) {
+      return false;
+    }
+
+    fresh = false;
+    show(front);
+    return true;
+  }
+
+  // Draws what is still queued, stops the thread and returns the last frame
+  const cv::Mat &finish() {
+    stop();
+    return front;
+  }
+
+  size_t get_drawn() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return drawn;
+  }
+  size_t get_dropped() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return dropped;
+  }
+
+private:
+  struct update {
+    cv::Point3f move;
+    utils::quat turn;
+    cv::Vec3f stretch = cv::Vec3f(1.0f, 1.0f, 1.0f);
+    bool redraw = false;
+  };
+
+  template <typename Change> void queue(Change change) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      change(pending);
+      pending.redraw = true;
+    }
+    changed.notify_one();
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    changed.notify_one();
+
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+
+  void run() {
+    while (true) {
+      update next;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&]() { return pending.redraw || stopping; });
+        if (!pending.redraw) {
+          return;
+        }
+        next = pending;
+        pending = update();
+      }
+
+      shape.translate(next.move);
+      shape.rotate(next.turn);
+      shape.scale(next.stretch);
+
+      // The back buffer is never shown
+      draw_shape(back, shape, light);
+
+      if (VERBOSITY >= 3) {
+        std::cout << "Redrew " << back.region.redrawn_pixels << " of "
+                  << WIDTH * HEIGHT << " pixels" << '\n';
+      }
+
+      // Swapping the headers moves no pixels. Each buffer keeps its region
+      std::lock_guard<std::mutex> guard(lock);
+      std::swap(back.image, front);
+      std::swap(back.region, front_region);
+      dropped += fresh;
+      fresh = true;
+      ++drawn;
+    }
+  }
+
+  Shape &shape;
+  const Light *light;
+  RenderTarget back; // Only touched by the render thread
+
+  mutable std::mutex lock; // Guards everything below
+  std::condition_variable changed;
+  update pending;
+  cv::Mat front;
+  redraw_region front_region; // What `front` had drawn into it
+  bool fresh = false; // Front buffer was not presented yet
+  bool stopping = false;
+  size_t drawn = 0;
+  size_t dropped = 0;
+
+  std::thread worker;
+};
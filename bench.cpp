@@ -0,0 +1,666 @@
+#include "includes.h"
+#include "node.h"
+#include "raycast.h"
+#include "scene.h"
+#include "settings.h"
+#include "shape_loader.h"
+#include "transform.h"
+#include "utils.h"
+#include "voxfile.h"
+#include "voxtext.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <sstream>
+
+// Stage benchmarks over synthetic solid spheres of several sizes.
+// Usage: bench [results.json] [model.vox]
+//
+// Every stage is timed separately and reported with its median, p99 and
+// throughput. A summary goes to stdout, the results to the JSON file.
+// Whole frames drawn into a RenderTarget are also checked to make no heap
+// allocation once warmed up, profiler scopes and their live output
+// included, and picks to agree with the ray caster. The exit status is 1 if
+// either fails.
+
+typedef std::chrono::steady_clock bench_clock;
+
+double elapsed_ms(bench_clock::time_point since) {
+  return std::chrono::duration<double, std::milli>(bench_clock::now() - since)
+      .count();
+}
+
+struct stage_result {
+  std::string stage;
+  int size;     // Edge of the synthetic volume, 0 if not volume based
+  size_t items; // Items processed per run
+  std::string unit;
+  std::vector<double> samples; // ms, sorted
+
+  double median() const { return samples[samples.size() / 2]; }
+  double p99() const {
+    size_t rank = (size_t)std::ceil(samples.size() * 0.99);
+    return samples[std::min(samples.size() - 1, rank > 0 ? rank - 1 : 0)];
+  }
+  double throughput() const { return items / (median() / 1000.0); }
+};
+
+std::vector<stage_result> results;
+std::vector<std::pair<std::string, double>> metrics; // Non-timing results
+volatile size_t sink; // Keeps benchmarked results alive
+
+// Heap allocations so far, counted by the replaced global operator new
+std::atomic<size_t> allocations(0);
+bool allocating_frames = false; // A steady state frame allocated
+bool wrong_picks = false;        // A pick disagreed with the ray caster
+
+void *operator new(size_t size) {
+  ++allocations;
+  if (void *p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+// Heap allocations of `frames` calls of fn, after warm-up calls that let
+// every buffer reach its size. Steady state frames must make none. The
+// profiler prints its scopes meanwhile, as it does in the other programs
+template <typename Fn>
+void check_allocations(const std::string &stage, int frames, Fn fn) {
+  profiler::live_output = VERBOSITY >= 4;
+  for (int i = 0; i < 3; ++i) {
+    fn();
+  }
+
+  size_t before = allocations;
+  for (int i = 0; i < frames; ++i) {
+    fn();
+  }
+  size_t made = allocations - before;
+  profiler::live_output = false;
+
+  metrics.emplace_back("allocations_" + stage, made);
+  std::cout << "ALLOCATIONS " << stage << " frames=" << frames << " " << made
+            << (made ? " (expected 0)" : "") << '\n';
+  allocating_frames |= made > 0;
+}
+
+// Runs fn `repeats` times after one warm-up run
+template <typename Fn>
+void measure(const std::string &stage, int size, size_t items,
+             const char *unit, int repeats, Fn fn) {
+  fn();
+
+  stage_result res;
+  res.stage = stage;
+  res.size = size;
+  res.items = items;
+  res.unit = unit;
+
+  for (int i = 0; i < repeats; ++i) {
+    auto start = bench_clock::now();
+    fn();
+    res.samples.push_back(elapsed_ms(start));
+  }
+  std::sort(res.samples.begin(), res.samples.end());
+
+  std::cout << "BENCH " << stage << " size=" << size << " items=" << items
+            << " median=" << res.median() << "ms p99=" << res.p99()
+            << "ms throughput=" << res.throughput() << " " << unit << '\n';
+  results.push_back(res);
+}
+
+// Pixel writes per covered pixel of one frame
+double overdraw(const screen_voxels &voxels, const utils::color_lut &lut) {
+  cv::Mat image(HEIGHT, WIDTH, CV_8UC3, (cv::Scalar)BACKGROUND_COLOR);
+  cv::Mat_<float> z_buffer(HEIGHT, WIDTH, -1.0f);
+  size_t written = splat_serial(image, voxels, lut, z_buffer);
+
+  size_t covered = 0;
+  for (int y = 0; y < HEIGHT; ++y) {
+    for (int x = 0; x < WIDTH; ++x) {
+      covered += z_buffer(y, x) > -1.0f;
+    }
+  }
+  return covered ? (double)written / covered : 0;
+}
+
+// Writes a solid sphere filling a size^3 volume in the text format
+void write_synthetic(const char *filename, int size) {
+  std::ofstream file(filename, std::ios::binary);
+  std::string row(size, ' ');
+  const float radius = size / 2.0f;
+
+  for (int z = 0; z < size; ++z) {
+    for (int y = 0; y < size; ++y) {
+      for (int x = 0; x < size; ++x) {
+        float dx = x - radius, dy = y - radius, dz = z - radius;
+        row[x] = dx * dx + dy * dy + dz * dz < radius * radius ? 'f' : ' ';
+      }
+      file << row << '\n';
+    }
+    file << '\n';
+  }
+}
+
+size_t file_size(const char *filename) {
+  std::ifstream file(filename, std::ios::binary | std::ios::ate);
+  return file ? (size_t)file.tellg() : 0;
+}
+
+// Returns the voxel count of the file
+size_t bench_parse(const char *filename, int size, int repeats) {
+  size_t voxels = 0;
+  voxtext::dims dims;
+
+  measure("parse", size, file_size(filename), "bytes/s", repeats, [&]() {
+    voxels = 0;
+    voxtext::parse(filename, dims, [&](int, int, int, char) { ++voxels; });
+  });
+
+  return voxels;
+}
+
+void bench_volume(int size, int repeats) {
+  const std::string text = "bench_" + to_string(size) + ".vox";
+  const std::string binary = "bench_" + to_string(size) + ".vxb";
+  write_synthetic(text.c_str(), size);
+
+  const size_t count = bench_parse(text.c_str(), size, repeats);
+
+  std::unique_ptr<Shape> shape;
+  measure("load_text", size, count, "voxels/s", repeats,
+          [&]() { shape.reset(new Shape(text.c_str(), {{'f', 360}})); });
+  const auto &vertices = shape->get_vertices();
+
+  voxfile::write(binary.c_str(), vertices, size, size, size, {{360, 'f'}});
+  measure("load_binary", size, count, "voxels/s", repeats,
+          [&]() { Shape loaded(binary.c_str(), {{'f', 360}}); });
+
+  std::remove(text.c_str());
+  std::remove(binary.c_str());
+
+  // Fit the volume on screen under a rotation
+  shape->translate(WIDTH / 2, HEIGHT / 2, 0.0f);
+  shape->rotate(30.0f, cv::Vec3f(0, 1.0f, 0));
+  float fit = 0.8f * HEIGHT / size;
+  shape->scale(fit, fit, fit);
+
+  screen_voxels voxels;
+  voxels.size = count;
+  voxels.color_ids = vertices.get_color_ids();
+  voxels.x.resize(count);
+  voxels.y.resize(count);
+  voxels.depth.resize(count);
+
+  for (auto isa : {batch::Isa::Scalar, batch::Isa::SSE2, batch::Isa::AVX2}) {
+    if (!batch::isa_supported(isa)) {
+      continue;
+    }
+
+    measure(std::string("transform_") + batch::isa_name(isa), size, count,
+            "voxels/s", repeats, [&]() {
+              batch::transform(shape->get_matx(), vertices.get_xs(),
+                               vertices.get_ys(), vertices.get_zs(), count,
+                               voxels.x.data(), voxels.y.data(),
+                               voxels.depth.data(), isa);
+            });
+  }
+
+  // Stepping along the grid in storage order, which is scanline order for
+  // parsed files, against the multiplied positions
+  screen_voxels stepped = voxels;
+  for (bool fixed : {false, true}) {
+    std::string name = fixed ? "fixed" : "float";
+    measure("transform_grid_" + name, size, count, "voxels/s", repeats,
+            [&]() {
+              batch::transform_grid(shape->get_matx(), vertices.get_xs(),
+                                    vertices.get_ys(), vertices.get_zs(),
+                                    nullptr, count, stepped.x.data(),
+                                    stepped.y.data(), stepped.depth.data(),
+                                    fixed);
+            });
+
+    double error = 0;
+    for (size_t i = 0; i < count; ++i) {
+      error = std::max(error, (double)std::abs(stepped.x[i] - voxels.x[i]));
+      error = std::max(error, (double)std::abs(stepped.y[i] - voxels.y[i]));
+    }
+    metrics.emplace_back("grid_error_" + name + "_" + to_string(size), error);
+    std::cout << "GRID_ERROR " << name << " size=" << size << " " << error
+              << " pixels" << '\n';
+  }
+
+  // The whole volume as runs along x, only span ends are multiplied
+  utils::span_storage spans(vertices);
+  screen_voxels expanded;
+  measure("transform_spans", size, count, "voxels/s", repeats, [&]() {
+    transform_spans(shape->get_matx(), spans, 0, expanded);
+  });
+
+  // The rendered surface, as points in storage order and as spans. Shapes
+  // only keep spans when they render with them
+  const auto &surface_points = shape->get_surface();
+  utils::span_storage surface_spans(surface_points,
+                                    shape->get_normals(0).data());
+  measure("transform_surface_points", size, surface_points.size(), "voxels/s",
+          repeats, [&]() {
+            transform_voxels(shape->get_matx(), surface_points, expanded);
+          });
+  measure("transform_surface_spans", size, surface_points.size(), "voxels/s",
+          repeats, [&]() {
+            transform_spans(shape->get_matx(), surface_spans, 0, expanded);
+          });
+
+  metrics.emplace_back("span_count_" + to_string(size), spans.size());
+  metrics.emplace_back("span_bytes_" + to_string(size), spans.memory());
+  metrics.emplace_back("point_bytes_" + to_string(size), count * 7);
+
+  // One target and its threads for every stage, each splat starts from a
+  // cleared screen like a new frame
+  RenderTarget target;
+  const auto &lut = shape->get_color_lut();
+  const cv::Rect screen(0, 0, WIDTH, HEIGHT);
+  auto serial = [&](const screen_voxels &drawn) {
+    clear_target(target, screen);
+    return splat_serial(target.image, drawn, lut, target.depth);
+  };
+  auto tiled = [&](const screen_voxels &drawn) {
+    clear_target(target, screen);
+    return splat_tiled(target.image, drawn, lut, target.pool, target.depth,
+                       target.bins);
+  };
+
+  measure("splat_serial", size, count, "voxels/s", repeats,
+          [&]() { serial(voxels); });
+  for (int radius = 0; radius <= MAX_SPLAT_RADIUS; ++radius) {
+    splat_radius = radius;
+    measure("splat_serial_r" + to_string(radius), size, count, "voxels/s",
+            repeats, [&]() { serial(voxels); });
+  }
+  splat_radius = 2;
+  measure("splat_tiled", size, count, "voxels/s", repeats,
+          [&]() { tiled(voxels); });
+
+  // Surface in file order against the front to back order of the view
+  screen_voxels view;
+  transform_shape(*shape, shape->get_matx(), view);
+  screen_voxels file_order = view;
+  file_order.order = nullptr;
+
+  for (const auto *order : {&file_order, &view}) {
+    std::string name = order == &view ? "view_order" : "file_order";
+    measure("splat_" + name, size, view.size, "voxels/s", repeats,
+            [&]() { tiled(*order); });
+
+    double ratio = overdraw(*order, lut);
+    metrics.emplace_back("overdraw_" + name + "_" + to_string(size), ratio);
+    std::cout << "OVERDRAW " << name << " size=" << size << " " << ratio
+              << '\n';
+  }
+
+  // Whole frames without and with lighting. Moving keeps the shades of the
+  // normals, turning recomputes them every frame
+  Light light;
+  target.region = redraw_region();
+  measure("draw_unlit", size, view.size, "voxels/s", repeats,
+          [&]() { draw_shape(target, *shape); });
+  measure("draw_lit", size, view.size, "voxels/s", repeats,
+          [&]() { draw_shape(target, *shape, &light); });
+  measure("draw_lit_moving", size, view.size, "voxels/s", repeats, [&]() {
+    shape->translate(0.01f, 0, 0);
+    draw_shape(target, *shape, &light);
+  });
+  measure("draw_lit_turning", size, view.size, "voxels/s", repeats, [&]() {
+    shape->rotate(0.01f, cv::Vec3f(0, 1.0f, 0));
+    draw_shape(target, *shape, &light);
+  });
+
+  check_allocations("draw_shape_" + to_string(size), 20, [&]() {
+    shape->translate(0.5f, 0, 0);
+    shape->rotate(1.0f, cv::Vec3f(0, 1.0f, 0));
+    draw_shape(target, *shape, &light);
+  });
+
+  // Shrunk to an eighth, the full surface against the chosen detail level
+  shape->scale(0.125f, 0.125f, 0.125f);
+  const size_t level = lod_level(shape->get_matx(), shape->get_level_count());
+  screen_voxels surface;
+
+  measure("draw_far_full", size, shape->get_surface().size(), "voxels/s",
+          repeats, [&]() {
+            transform_voxels(shape->get_matx(), shape->get_surface(), surface);
+            tiled(surface);
+          });
+  measure("draw_far_lod" + to_string(level), size,
+          shape->get_level(level).size(), "voxels/s", repeats, [&]() {
+            transform_voxels(lod_matx(shape->get_matx(), level),
+                             shape->get_level(level), surface);
+            tiled(surface);
+          });
+
+  std::mt19937 rng(size);
+  std::uniform_int_distribution<int> coord(-size / 2, size / 2);
+  std::vector<cv::Point3i> queries(1 << 16);
+  for (auto &q : queries) {
+    q = cv::Point3i(coord(rng), coord(rng), coord(rng));
+  }
+
+  measure("point_storage_has", size, queries.size(), "queries/s", repeats,
+          [&]() {
+            size_t hits = 0;
+            for (const auto &q : queries) {
+              hits += vertices.has(q.x, q.y, q.z);
+            }
+            sink = hits;
+          });
+  measure("shape_at", size, queries.size(), "queries/s", repeats, [&]() {
+    size_t hits = 0;
+    for (const auto &q : queries) {
+      hits += shape->at(q.x, q.y, q.z);
+    }
+    sink = hits;
+  });
+
+  // The same points as columns, answered 64 to a word
+  const auto &occupancy = shape->get_occupancy();
+  std::vector<int16_t> qx, qy, qz;
+  for (const auto &q : queries) {
+    qx.push_back(q.x);
+    qy.push_back(q.y);
+    qz.push_back(q.z);
+  }
+  std::vector<uint64_t> hits(queries.size() / 64);
+  measure("occupancy_points", size, queries.size(), "queries/s", repeats,
+          [&]() {
+            sink = occupancy.has(qx.data(), qy.data(), qz.data(),
+                                 queries.size(), hits.data());
+          });
+
+  // Every cell of the middle slab, row by row. Rows of at least 64 cells
+  // are answered from their words, shorter ones point by point
+  qx.clear();
+  qy.clear();
+  qz.clear();
+  for (int z = -size / 8; z < size / 8; ++z) {
+    for (int y = -size / 2; y < size / 2; ++y) {
+      for (int x = -size / 2; x < size / 2; ++x) {
+        qx.push_back(x);
+        qy.push_back(y);
+        qz.push_back(z);
+      }
+    }
+  }
+  hits.resize((qx.size() + 63) / 64);
+  measure("occupancy_rows", size, qx.size(), "queries/s", repeats, [&]() {
+    sink = occupancy.has(qx.data(), qy.data(), qz.data(), qx.size(),
+                         hits.data());
+  });
+
+  // Boxes a quarter of the model wide
+  const int edge = size / 4;
+  measure("occupancy_box", size, queries.size(), "boxes/s", repeats, [&]() {
+    size_t voxels = 0;
+    for (const auto &q : queries) {
+      voxels += occupancy.count(q, q + cv::Point3i(edge, edge, edge));
+    }
+    sink = voxels;
+  });
+
+  // Every 4th pixel of the screen, the shape still fit and turned
+  const size_t picks = (WIDTH / 4) * (HEIGHT / 4);
+  shape->scale(8.0f, 8.0f, 8.0f);
+  measure("shape_pick", size, picks, "pixels/s", repeats, [&]() {
+    size_t picked = 0;
+    cv::Point3i voxel;
+    for (int y = 0; y < HEIGHT; y += 4) {
+      for (int x = 0; x < WIDTH; x += 4) {
+        picked += shape->pick(x, y, voxel);
+      }
+    }
+    sink = picked;
+  });
+
+  metrics.emplace_back("occupancy_bytes_" + to_string(size),
+                       occupancy.memory());
+}
+
+// A grid of instances of one model, most of them off screen
+void bench_scene(int repeats) {
+  const int size = 32, columns = 32;
+  const char *text = "bench_scene.vox";
+  write_synthetic(text, size);
+  auto shape = std::make_shared<const Shape>(text, color_pairs{{'f', 360}});
+  std::remove(text);
+
+  Scene scene;
+  for (int i = 0; i < columns * columns; ++i) {
+    auto &instance = scene.add(shape);
+    instance.translate(i % columns * 60.0f, i / columns * 60.0f, 0.0f);
+    instance.rotate(i * 7.0f, cv::Vec3f(0, 1.0f, 0));
+    instance.scale(1.5f, 1.5f, 1.5f);
+  }
+
+  screen_box screen;
+  screen.x1 = WIDTH;
+  screen.y1 = HEIGHT;
+  measure("scene_cull", 0, scene.size(), "instances/s", repeats,
+          [&]() { sink = scene.visible(screen).size(); });
+
+  RenderTarget target;
+  measure("draw_scene", 0, scene.size(), "instances/s", repeats,
+          [&]() { sink = draw_scene(target, scene); });
+
+  check_allocations("draw_scene", 20, [&]() {
+    scene.at(0).rotate(1.0f, cv::Vec3f(0, 1.0f, 0));
+    sink = draw_scene(target, scene);
+  });
+}
+
+// Whole frames of growing volumes fit to the same screen area, splatted
+// with and without detail levels against ray casting. Records the smallest
+// volume where rays win
+void bench_raycast(int repeats) {
+  int crossover_lod = 0, crossover_full = 0;
+
+  for (int size : {16, 32, 64, 128, 256}) {
+    const std::string text = "bench_rays_" + to_string(size) + ".vox";
+    write_synthetic(text.c_str(), size);
+    Shape shape(text.c_str(), {{'f', 360}});
+    std::remove(text.c_str());
+
+    shape.translate(WIDTH / 2, HEIGHT / 2, 0.0f);
+    shape.rotate(30.0f, cv::Vec3f(0, 1.0f, 0.3f));
+    float fit = 0.8f * HEIGHT / size;
+    shape.scale(fit, fit, fit);
+
+    RenderTarget target;
+    const size_t voxels = shape.get_surface().size();
+    auto median = [&](const char *stage, auto fn) {
+      measure(stage + ("_" + to_string(size)), size, voxels, "voxels/s",
+              repeats, fn);
+      return results.back().median();
+    };
+
+    double lod = median("frame_splat_lod", [&]() {
+      target.region = redraw_region();
+      draw_shape(target, shape);
+    });
+    double full = median("frame_splat_full", [&]() {
+      clear_target(target, cv::Rect(0, 0, WIDTH, HEIGHT));
+      transform_voxels(shape.get_matx(), shape.get_surface(), target.voxels);
+      target.voxels.order = shape.get_order(0, view_octant(shape.get_matx()))
+                                .data();
+      target.voxels.shades = nullptr;
+      splat_target(target, shape.get_color_lut());
+    });
+    double rays =
+        median("frame_rays", [&]() { cast_shape(target, shape); });
+
+    if (!crossover_lod && rays < lod) {
+      crossover_lod = size;
+    }
+    if (!crossover_full && rays < full) {
+      crossover_full = size;
+    }
+  }
+
+  metrics.emplace_back("raycast_crossover_lod", crossover_lod);
+  metrics.emplace_back("raycast_crossover_full", crossover_full);
+  std::cout << "CROSSOVER rays beat splats from size " << crossover_lod
+            << " with detail levels, " << crossover_full
+            << " without (0 - never)" << '\n';
+}
+
+// Picks of every other pixel against the hits of cast_shape(), on volumes
+// whose edges are not whole occupancy blocks. A picked voxel must exist
+void check_picks() {
+  RenderTarget target;
+
+  for (int size : {5, 6, 13}) {
+    const std::string text = "bench_pick_" + to_string(size) + ".vox";
+    write_synthetic(text.c_str(), size);
+    Shape shape(text.c_str(), {{'f', 360}});
+    std::remove(text.c_str());
+
+    shape.translate(WIDTH / 2, HEIGHT / 2, 0.0f);
+    float fit = 0.5f * HEIGHT / size;
+    shape.scale(fit, fit, fit);
+
+    size_t wrong = 0;
+    for (int pose = 0; pose < 4; ++pose) {
+      cast_shape(target, shape);
+      for (int y = 0; y < HEIGHT; y += 2) {
+        for (int x = 0; x < WIDTH; x += 2) {
+          cv::Point3i voxel;
+          bool picked = shape.pick(x, y, voxel);
+          wrong += picked != (target.depth(y, x) > -1.0f) ||
+                   (picked && !shape.at(voxel.x, voxel.y, voxel.z));
+        }
+      }
+      shape.rotate(pose ? 35.0f : 90.0f, cv::Vec3f(pose % 2, 1.0f, 0.2f));
+    }
+
+    metrics.emplace_back("pick_mismatches_" + to_string(size), wrong);
+    std::cout << "PICKS size=" << size << " " << wrong << " wrong"
+              << (wrong ? " (expected 0)" : "") << '\n';
+    wrong_picks |= wrong > 0;
+  }
+}
+
+// A set of model files loaded one after another, on the loader's threads
+// and again from its cache
+void bench_loader(int repeats) {
+  const int size = 48, files = 16;
+  std::vector<std::string> paths;
+  for (int i = 0; i < files; ++i) {
+    paths.push_back("bench_load_" + to_string(i) + ".vox");
+    write_synthetic(paths.back().c_str(), size);
+  }
+  const color_pairs colors = {{'f', 360}};
+  const size_t voxels = Shape(paths[0].c_str(), colors).get_vertices().size();
+
+  measure("load_many_serial", size, voxels * files, "voxels/s", repeats,
+          [&]() {
+            for (const auto &path : paths) {
+              Shape shape(path.c_str(), colors);
+            }
+          });
+
+  shape_loader loader;
+  measure("load_many_parallel", size, voxels * files, "voxels/s", repeats,
+          [&]() {
+            loader.clear();
+            loader.load(paths, colors);
+          });
+  measure("load_many_cached", size, voxels * files, "voxels/s", repeats,
+          [&]() { loader.load(paths, colors); });
+
+  for (const auto &path : paths) {
+    std::remove(path.c_str());
+  }
+}
+
+void bench_colors(int repeats) {
+  const int count = 10000;
+
+  measure("hsv_to_bgr", 0, count, "colors/s", repeats, [&]() {
+    size_t sum = 0;
+    for (int i = 0; i < count; ++i) {
+      sum += utils::HSVtoBGR(cv::Vec3f(i % 360, 100, 100))[0];
+    }
+    sink = sum;
+  });
+
+  utils::color_lut lut({360, 200, 100});
+  measure("color_lut", 0, count, "colors/s", repeats, [&]() {
+    size_t sum = 0;
+    for (int i = 0; i < count; ++i) {
+      sum += lut.at(i % 3, (i % 32) / 31.0f)[0];
+    }
+    sink = sum;
+  });
+}
+
+std::string to_json() {
+  std::ostringstream json;
+  json << "{\n  \"config\": {\"width\": " << WIDTH << ", \"height\": " << HEIGHT
+       << ", \"threads\": " << std::thread::hardware_concurrency()
+       << ", \"isa\": \"" << batch::isa_name(batch::best_isa()) << "\"},\n"
+       << "  \"results\": [";
+
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto &r = results[i];
+    json << (i ? ",\n" : "\n") << "    {\"stage\": \"" << r.stage
+         << "\", \"size\": " << r.size << ", \"items\": " << r.items
+         << ", \"samples\": " << r.samples.size()
+         << ", \"median_ms\": " << r.median() << ", \"p99_ms\": " << r.p99()
+         << ", \"throughput\": " << r.throughput() << ", \"unit\": \""
+         << r.unit << "\"}";
+  }
+
+  json << "\n  ],\n  \"metrics\": {";
+  for (size_t i = 0; i < metrics.size(); ++i) {
+    json << (i ? ", " : "") << "\"" << metrics[i].first
+         << "\": " << metrics[i].second;
+  }
+
+  json << "}\n}\n";
+  return json.str();
+}
+
+int main(int argc, char **argv) {
+  const char *output = argc > 1 ? argv[1] : "bench_results.json";
+  const char *model = argc > 2 ? argv[2] : "sphere.vox";
+  profiler::live_output = false; // Only the allocation checks print scopes
+
+  for (int size : {32, 64, 128}) {
+    bench_volume(size, size >= 128 ? 5 : 21);
+  }
+
+  // A real model next to a large synthetic one
+  if (file_size(model) > 0) {
+    bench_parse(model, 0, 20);
+  } else {
+    std::cout << "Cannot open " << model << ", skipping its parse" << '\n';
+  }
+
+  const char *large = "bench_512.vox";
+  write_synthetic(large, 512);
+  bench_parse(large, 512, 3);
+  std::remove(large);
+
+  bench_scene(21);
+  bench_raycast(11);
+  check_picks();
+  bench_loader(5);
+  bench_colors(21);
+
+  std::ofstream(output) << to_json();
+  std::cout << "Results written to " << output << '\n';
+
+  return allocating_frames || wrong_picks ? 1 : 0;
+}
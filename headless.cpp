@@ -0,0 +1,192 @@
+#include "includes.h"
+#include "node.h"
+#include "raycast.h"
+#include "settings.h"
+#include "utils.h"
+
+#include <chrono>
+#include <sstream>
+
+// Renders frames straight to image files, no window or event loop.
+// Usage: headless <model> <script> <output pattern> [<symbol>=<hue>...]
+//
+// Every line of the script is one frame. It lists transforms applied to the
+// shape before that frame is rendered, and they accumulate like the
+// interactive controls do:
+//
+//   translate 400 300 0 scale 3 3 3
+//   rotate 15 0 1 0
+//   radius 1
+//   raycast 1
+//
+// `radius` sets the splat radius from then on, 0 to MAX_SPLAT_RADIUS.
+// `raycast 1` draws the following frames by casting rays instead of
+// splatting voxels, `raycast 0` switches back.
+// Blank lines render the current state again, '#' starts a comment. The
+// output pattern takes the frame number once as %d, %Nd or %0Nd, e.g.
+// frame_%04d.png, a literal '%' is written %%
+
+bool cast_rays = false;
+
+// Output file names, the pattern split around its frame number
+struct frame_pattern {
+  std::string prefix;
+  std::string suffix;
+  size_t width = 0; // Padded to with `fill`
+  char fill = ' ';
+
+  std::string name(int frame) const {
+    std::string number = std::to_string(frame);
+    if (number.size() < width) {
+      number.insert(0, width - number.size(), fill);
+    }
+    return prefix + number + suffix;
+  }
+};
+
+// Splits the output pattern around its frame number. It is never used as
+// a printf format, anything but one conversion and "%%" is refused
+bool parse_pattern(const std::string &text, frame_pattern &pattern) {
+  std::string *part = &pattern.prefix;
+  bool found = false;
+
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (text[i] != '%') {
+      *part += text[i];
+      continue;
+    }
+    if (i + 1 < text.size() && text[i + 1] == '%') {
+      *part += '%';
+      ++i;
+      continue;
+    }
+
+    // At most 3 digits of width, then the 'd'
+    size_t end = text.find_first_not_of("0123456789", i + 1);
+    if (found || end == std::string::npos || text[end] != 'd' ||
+        end - i - 1 > 3) {
+      found = false;
+      break;
+    }
+    pattern.fill = text[i + 1] == '0' ? '0' : ' ';
+    pattern.width = end > i + 1 ? std::stoul(text.substr(i + 1, end - i - 1))
+                                : 0;
+    found = true;
+    part = &pattern.suffix;
+    i = end;
+  }
+
+  if (!found) {
+    std::cout << "Bad output pattern '" << text
+              << "', expected one %d, %Nd or %0Nd and %% for a literal %"
+              << '\n';
+  }
+  return found;
+}
+
+bool apply_transforms(const std::string &line, Shape &shape) {
+  std::istringstream ops(line.substr(0, line.find('#')));
+  std::string op;
+
+  while (ops >> op) {
+    float a, b, c, d;
+    int radius, rays;
+
+    if (op == "radius" && ops >> radius && radius >= 0 &&
+        radius <= MAX_SPLAT_RADIUS) {
+      splat_radius = radius;
+    } else if (op == "raycast" && ops >> rays) {
+      cast_rays = rays != 0;
+    } else if (op == "translate" && ops >> a >> b >> c) {
+      shape.translate(a, b, c);
+    } else if (op == "scale" && ops >> a >> b >> c) {
+      shape.scale(a, b, c);
+    } else if (op == "rotate" && ops >> a >> b >> c >> d) {
+      shape.rotate(a, cv::Vec3f(b, c, d));
+    } else {
+      std::cout << "Bad transform '" << op << "' in '" << line << "'" << '\n';
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    std::cout << "Usage: " << argv[0]
+              << " <model> <script> <output pattern> [<symbol>=<hue>...]\n"
+              << "Example: " << argv[0]
+              << " sphere.vox turntable.txt frame_%04d.png f=360 e=200 d=100\n";
+    return 1;
+  }
+
+  color_pairs colors;
+  for (int i = 4; i < argc; ++i) {
+    if (!parse_color_pair(argv[i], colors)) {
+      return 1;
+    }
+  }
+
+  frame_pattern pattern;
+  if (!parse_pattern(argv[3], pattern)) {
+    return 1;
+  }
+
+  std::ifstream script(argv[2]);
+  if (!script) {
+    std::cout << "Cannot open " << argv[2] << '\n';
+    return 1;
+  }
+
+  Shape shape(argv[1], colors.empty() ? color_pairs{{'0', 360}} : colors);
+  RenderTarget target;
+
+  std::string line;
+  int frame = 0;
+  double total_ms = 0;
+
+  while (std::getline(script, line)) {
+    auto first = line.find_first_not_of(" \t");
+    if (first != std::string::npos && line[first] == '#') {
+      continue;
+    }
+
+    if (!apply_transforms(line, shape)) {
+      return 1;
+    }
+
+    const std::string filename = pattern.name(frame);
+
+    auto start = std::chrono::steady_clock::now();
+    if (cast_rays) {
+      cast_shape(target, shape);
+    } else {
+      draw_shape(target, shape);
+    }
+    if (!cv::imwrite(filename, target.image)) {
+      std::cout << "Cannot write " << filename << '\n';
+      return 1;
+    }
+    double took = std::chrono::duration<double, std::milli>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+
+    total_ms += took;
+    std::cout << "Frame " << frame << " -> " << filename << " took " << took
+              << "ms" << '\n';
+    ++frame;
+  }
+
+  if (frame > 0) {
+    std::cout << frame << " frames in " << total_ms << "ms, "
+              << total_ms / frame << "ms per frame" << '\n';
+  }
+
+  if (TIME_MEASURE) {
+    profiler::report(std::cout);
+    profiler::write_trace("trace.json");
+  }
+
+  return 0;
+}
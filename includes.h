@@ -1,7 +1,10 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <cassert>
 #include <cmath>
+#include <cstdint>
 #include <ctime>
 #include <fstream>
 #include <iostream>
@@ -11,6 +14,8 @@
 #include <opencv2/opencv.hpp>
 #include <string>
 #include <tgmath.h>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 // #define sp std::shared_ptr
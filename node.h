@@ -5,72 +5,81 @@ class Shape;
 class Light;
 
 #include "includes.h"
+#include "profiler.h"
 #include "settings.h"
+#include "transform.h"
 #include "utils.h"
+#include "voxfile.h"
+#include "voxtext.h"
 
 using std::to_string;
 
+// Position, orientation and scale of an object. The model matrix is
+// translate * rotate * scale and is only rebuilt when it is asked for after
+// one of them changed
 class Node {
 public:
   Node(int width = 1, int height = 1, int depth = 1,
        cv::Point3f center = cv::Point3f())
       : width(width), height(height), depth(depth), center(center) {
     position = cv::Point3f();
-    rotation = cv::Vec3f();
     scaling = cv::Vec3f(1.0f, 1.0f, 1.0f);
-    matx = cv::Matx44f::eye();
   }
 
+  // Moves along the world axes
   void translate(float x, float y, float z) {
-    reset_rotation();
-    reset_scale();
-    matx = matx * utils::translate(x, y, z);
-    restore_scale();
-    restore_rotation();
-
     position += cv::Point3f(x, y, z);
+    dirty = true;
+    ++revision;
   }
   void translate(const cv::Point3f &p) { translate(p.x, p.y, p.z); }
 
+  // Scales along the object's own axes
   void scale(float x, float y, float z) {
-    reset_transform();
-    reset_rotation();
-    reset_scale();
-    matx = matx * utils::scale(x, y, z);
-    restore_scale();
-    restore_rotation();
-    restore_transform();
-
-    cv::Vec3f new_scale =
-        cv::Vec3f(utils::get_at(matx, 0, 0), utils::get_at(matx, 1, 1),
-                  utils::get_at(matx, 2, 2));
-
-    scaling = new_scale;
+    scaling = cv::Vec3f(scaling[0] * x, scaling[1] * y, scaling[2] * z);
+    dirty = true;
+    ++revision;
   }
   void scale(const cv::Vec3f &v) { scale(v.val[0], v.val[1], v.val[2]); }
 
+  // Rotates within the object's own frame
+  void rotate(const utils::quat &turn) {
+    orientation = (orientation * turn).normalized();
+    dirty = true;
+    ++revision;
+  }
+  // Angle in degrees
   void rotate(float angle, cv::Vec3f axis) {
-    auto old_matx = matx;
-
-    reset_transform();
-    reset_scale();
-    matx = matx * utils::rotate(angle, axis);
-    restore_scale();
-    restore_transform();
-
-    rotation.val[0] += axis.val[0] * angle;
-    rotation.val[1] += axis.val[1] * angle;
-    rotation.val[2] += axis.val[2] * angle;
+    rotate(utils::quat::from_axis_angle(angle, axis));
   }
   void rotate(cv::Vec3f values) { rotate(1.0f, values); }
 
+  // Replaces the whole transform
+  void place(const cv::Point3f &p, const utils::quat &turn,
+             const cv::Vec3f &s) {
+    position = p;
+    orientation = turn.normalized();
+    scaling = s;
+    dirty = true;
+    ++revision;
+  }
+
   int get_width() const { return width; }
   int get_height() const { return height; }
   int get_depth() const { return depth; }
-  cv::Matx44f get_matx() const { return matx; }
+  const cv::Matx44f &get_matx() const {
+    if (dirty) {
+      matx = utils::trs(position, orientation, scaling);
+      dirty = false;
+    }
+    return matx;
+  }
   cv::Point3f get_pos() const { return position; }
-  cv::Vec3f get_rot() const { return rotation; }
+  cv::Vec3f get_rot() const { return orientation.to_euler(); }
+  const utils::quat &get_orientation() const { return orientation; }
   cv::Vec3f get_sc() const { return scaling; }
+  // Changes with every transform, lets owners notice a moved node
+  uint64_t get_revision() const { return revision; }
   std::string get_dims() const {
     return utils::curlify({"width", to_string(width).c_str(), "height",
                            to_string(height).c_str(), "depth",
@@ -78,131 +87,133 @@ public:
   }
 
 protected:
-  cv::Matx44f reset_transform() {
-    auto move = utils::translate(-position);
-    return matx * move;
-  }
-
-  cv::Matx44f restore_transform() {
-    auto move = utils::translate(position);
-    return matx * move;
-  }
-
-  cv::Matx44f reset_rotation() {
-    auto rotate_x = utils::rotate(-rotation.val[0], cv::Vec3f(1.0f, 0, 0));
-    auto rotate_y = utils::rotate(-rotation.val[1], cv::Vec3f(0, 1.0f, 0));
-    auto rotate_z = utils::rotate(-rotation.val[2], cv::Vec3f(0, 0, 1.0f));
-    return matx * rotate_x * rotate_y * rotate_z;
-  }
-
-  cv::Matx44f restore_rotation() {
-    auto rotate_x = utils::rotate(rotation.val[0], cv::Vec3f(1.0f, 0, 0));
-    auto rotate_y = utils::rotate(rotation.val[1], cv::Vec3f(0, 1.0f, 0));
-    auto rotate_z = utils::rotate(rotation.val[2], cv::Vec3f(0, 0, 1.0f));
-    return matx * rotate_z * rotate_y * rotate_x;
-  }
-
-  cv::Matx44f reset_scale() {
-    auto scale = utils::scale(scaling);
-    return matx * scale.inv();
-  }
-
-  cv::Matx44f restore_scale() {
-    auto scale = utils::scale(scaling);
-    return matx * scale;
-  }
-
   int width;
   int height;
   int depth;
   cv::Point3f center;
-  cv::Matx44f matx;
   cv::Point3f position;
-  cv::Vec3f rotation;
+  utils::quat orientation;
   cv::Vec3f scaling;
+
+private:
+  mutable cv::Matx44f matx = cv::Matx44f::eye();
+  mutable bool dirty = false;
+  uint64_t revision = 0;
 };
 
-typedef std::map<char, int> color_pairs;
-class Shape : public Node {
+// Directional light, parallel rays along `direction` rotated by the node's
+// orientation. Voxels facing away from it keep the ambient intensity
+class Light : public Node {
 public:
-  explicit Shape(const char *filename, const color_pairs &colors = {{'0', 360}})
-      : Node(), color_groups(colors) {
+  explicit Light(cv::Vec3f direction = cv::Vec3f(0.5f, 0.5f, -1.0f),
+                 float ambient = 0.25f)
+      : Node(), ambient(ambient) {
+    this->direction = direction * (1.0f / std::sqrt(direction.dot(direction)));
+  }
 
-    utils::Timer::start_measure("Shape loading");
-    std::ifstream shapefile(filename);
-    std::string buffer(
-        (std::istreambuf_iterator<char>(shapefile)),
-        std::istreambuf_iterator<char>()); // Buffer is raw file content
+  void scale() = delete;
+  cv::Vec3f get_direction() const { return orientation.rotate(direction); }
+  float get_ambient() const { return ambient; }
 
-    shapefile.close();
+private:
+  cv::Vec3f direction;
+  float ambient;
+};
 
-    if (VERBOSITY >= 3) {
-      std::cout << "\nShape buffer size is " << buffer.size() << '\n';
+// Intensity of every encoded normal (see utils::encode_normal) of a node
+// under a light. World normals only depend on the node's orientation and
+// scale, so moving the node keeps the table. It is kept by whoever draws,
+// the render target or a scene instance, shared shapes hold none
+class shade_table {
+public:
+  const float *lookup(const Node &node, const Light &light) {
+    const auto &turn = node.get_orientation();
+    const auto scaling = node.get_sc();
+    const auto towards = light.get_direction() * -1.0f;
+    const float inputs[INPUTS] = {turn.w,     turn.x,     turn.y,
+                                  turn.z,     scaling[0], scaling[1],
+                                  scaling[2], towards[0], towards[1],
+                                  towards[2], light.get_ambient()};
+
+    if (!filled || !std::equal(inputs, inputs + INPUTS, lit_inputs)) {
+      recompute(turn, scaling, towards, light.get_ambient());
+      std::copy(inputs, inputs + INPUTS, lit_inputs);
+      filled = true;
     }
+    return intensities;
+  }
 
-    { // Get cube dimensions
-      int i = 0;
-      for (; i < (int)buffer.size() && buffer[i] != '\n'; i++) {
-      }
-      width = height = depth = i;
-      center = cv::Point3f(width / 2, height / 2, depth / 2);
+private:
+  static const int INPUTS = 11;
+
+  void recompute(const utils::quat &turn, const cv::Vec3f &scaling,
+                 const cv::Vec3f &towards, float ambient) {
+    PROFILE_SCOPE("Shading normals");
+    for (int code = 0; code < 256; ++code) {
+      // Normals transform by the inverse transpose of rotate * scale
+      auto n = utils::decode_normal((uint8_t)code);
+      n = turn.rotate(cv::Vec3f(n[0] / scaling[0], n[1] / scaling[1],
+                                n[2] / scaling[2]));
+      float diffuse = std::max(0.0f, n.dot(towards) / std::sqrt(n.dot(n)));
+      intensities[code] = ambient + (1 - ambient) * diffuse;
     }
+  }
 
-    std::string working_buffer;
+  // Orientation, scale, light direction and ambient the table is for
+  float lit_inputs[INPUTS];
+  bool filled = false;
+  float intensities[256];
+};
 
-    {
-      for (int i = 0; i < buffer.size(); ++i) {
-        auto ch = buffer[i];
-        if (ch == '\n') {
-          continue;
-        }
+typedef std::map<char, int> color_pairs;
 
-        working_buffer.push_back(ch);
-      }
-    }
+// Parses a "<symbol>=<hue>" command line argument into `colors`
+bool parse_color_pair(const std::string &arg, color_pairs &colors) {
+  auto pair = utils::split(arg, "=");
+  if (pair.size() != 2 || pair[0].size() != 1 || pair[1].empty() ||
+      pair[1].find_first_not_of("0123456789") != std::string::npos) {
+    std::cout << "Bad color group '" << arg << "', expected <symbol>=<hue>"
+              << '\n';
+    return false;
+  }
 
-    std::string unknown_chars = "";
-    std::string char_groups = "";
-
-    // Handle all points and save them with half width/height/depth offset
-    for (int z = 0; z < depth; ++z) {
-      for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-          char ch = working_buffer.at(x + y * height + z * width * height);
-          if (ch != ' ') {
-            auto known_char = char_groups.find(ch);
-            if (known_char == std::string::npos) {
-              char_groups += ch;
-
-              if (color_groups.find(ch) == color_groups.end()) {
-                unknown_chars += ch;
-                std::cout << "Unknown char " << ch << '\n';
-                exit(1);
-              }
-            }
+  colors[pair[0][0]] = std::stoi(pair[1]);
+  return true;
+}
 
-            vertices.save(x - width / 2, y - height / 2, z - depth / 2,
-                          color_groups.find(ch)->second);
-          }
-        }
-      }
+class Shape : public Node {
+public:
+  // Loads either a text .vox file or a binary file written by vox2bin. For
+  // binary files `colors` overrides the stored palette by symbol. Progress
+  // messages go to `log`, errors that end the program to stdout
+  explicit Shape(const char *filename, const color_pairs &colors = {{'0', 360}},
+                 std::ostream &log = std::cout)
+      : Node(), color_groups(colors), log(&log) {
+    PROFILE_SCOPE("Shape loading");
+
+    if (voxfile::is_binary(filename)) {
+      load_binary(filename);
+    } else {
+      load_text(filename);
     }
-
-    if (char_groups.size() > color_groups.size()) {
-      std::cout << "Expected " << char_groups.size() << " color groups "
-                << color_groups.size() << " given. Used '" << char_groups
-                << "'. Unknown chars are: '" << unknown_chars << "'" << '\n';
-      exit(1);
+    color_table = utils::color_lut(vertices.get_palette());
+    build_occupancy();
+    extract_surface();
+    build_normals();
+    build_levels();
+    build_orders();
+    if (RENDER_SPANS) {
+      build_spans();
     }
+    build_bricks();
 
     if (VERBOSITY >= 2) {
-      std::cout << "Shape " << filename << " loaded with " << get_dims()
-                << " Dimensions" << std::endl;
+      log << "Shape " << filename << " loaded with " << get_dims()
+          << " Dimensions" << std::endl;
 
-      std::cout << "At position " << utils::curlify(get_pos()) << "\n"
-                << std::endl;
+      log << "At position " << utils::curlify(get_pos()) << "\n" << std::endl;
     }
-    utils::Timer::end_measure();
+    this->log = &std::cout; // `log` may not outlive the constructor
   }
 
   std::string as_string() const {
@@ -240,137 +251,833 @@ public:
     return res;
   }
 
-  bool at(int x, int y, int z) const {
-    if ((x < 0) || (x > width) || (y < 0) || (y > height) || (z < 0) ||
-        (z > depth)) { // Check if out of bounds
+  // Whether the voxel at model coordinates, centered like get_vertices(),
+  // is set. Everything outside of the width x height x depth box is empty
+  bool at(int x, int y, int z) const { return occupancy.has(x, y, z); }
+
+  // First voxel under the screen pixel (x, y) as drawn with the current
+  // transform, looking into the screen. Returns it in model coordinates
+  bool pick(int x, int y, cv::Point3i &voxel) const {
+    const cv::Matx44f inv = utils::affine_inverse(get_matx());
+    const auto lower = occupancy.get_lower();
+    const float sx = x + 0.5f, sy = y + 0.5f;
+
+    // Voxel centers sit in the middle of their cells
+    utils::grid_ray ray;
+    ray.origin = cv::Vec3f(
+        inv(0, 0) * sx + inv(0, 1) * sy + inv(0, 3) - lower.x + 0.5f,
+        inv(1, 0) * sx + inv(1, 1) * sy + inv(1, 3) - lower.y + 0.5f,
+        inv(2, 0) * sx + inv(2, 1) * sy + inv(2, 3) - lower.z + 0.5f);
+    ray.dir = cv::Vec3f(-inv(0, 2), -inv(1, 2), -inv(2, 2));
+
+    uint32_t slot;
+    cv::Vec3i cell;
+    float s;
+    if (!utils::cast_ray(occupancy, ray, slot, cell, s)) {
       return false;
     }
-
-    return vertices.has(x, y, z);
+    voxel = cv::Point3i(cell[0] + lower.x, cell[1] + lower.y,
+                        cell[2] + lower.z);
+    return true;
   }
 
-  utils::point_storage get_vertices() const { return vertices; }
+  const utils::point_storage &get_vertices() const { return vertices; }
+  // Every voxel of the model as bits, for batched queries
+  const utils::occupancy_volume &get_occupancy() const { return occupancy; }
+  // Voxels that are not enclosed on all six sides, the ones worth rendering
+  const utils::point_storage &get_surface() const { return surface; }
+  const utils::color_lut &get_color_lut() const { return color_table; }
+  // Level 0 is the surface, every further level halves the resolution
+  size_t get_level_count() const { return levels.size() + 1; }
+  const utils::point_storage &get_level(size_t level) const {
+    return level == 0 ? surface : levels[level - 1];
+  }
+  // Voxel indices of a detail level sorted for one of the eight octants,
+  // see build_orders()
+  const std::vector<unsigned> &get_order(size_t level, int octant) const {
+    return orders[level * 8 + octant];
+  }
+  // The voxels of a detail level as runs along x. Only built when
+  // RENDER_SPANS is set, the points serve every other path
+  const utils::span_storage &get_spans(size_t level) const {
+    return spans[level];
+  }
+  // Encoded normal of every voxel of a detail level, in storage order
+  const std::vector<uint8_t> &get_normals(size_t level) const {
+    return normals[level];
+  }
+  // The surface in bricks, for casting rays
+  const utils::brick_volume &get_bricks() const { return bricks; }
+  // Smallest and largest voxel coordinates of the model
+  cv::Point3i get_lower() const { return lower; }
+  cv::Point3i get_upper() const { return upper; }
 
 private:
+  // Streams the text file, voxels are saved uncentered and moved by half
+  // width/height/depth once the dimensions are known
+  void load_text(const char *filename) {
+    int hues[256];
+    std::fill(hues, hues + 256, -1);
+    for (auto group : color_groups) {
+      hues[(uint8_t)group.first] = group.second;
+    }
+
+    voxtext::dims size;
+    bool loaded = voxtext::parse(
+        filename, size, [&](int x, int y, int z, char ch) {
+          int hue = hues[(uint8_t)ch];
+          if (hue < 0) {
+            std::cout << "Unknown char " << ch << '\n';
+            exit(1);
+          }
+
+          vertices.save(x, y, z, hue);
+        });
+
+    if (!loaded) {
+      std::cout << "Cannot open " << filename << '\n';
+      exit(1);
+    }
+
+    width = size.width;
+    height = size.height;
+    depth = size.depth;
+    center = cv::Point3f(width / 2, height / 2, depth / 2);
+
+    vertices.shift(-width / 2, -height / 2, -depth / 2);
+  }
+
+  void build_occupancy() {
+    PROFILE_SCOPE("Building occupancy");
+    occupancy = utils::occupancy_volume(
+        vertices, cv::Point3i(-width / 2, -height / 2, -depth / 2),
+        cv::Point3i(width, height, depth));
+
+    if (VERBOSITY >= 3) {
+      *log << "Occupancy: " << occupancy.memory() << " bytes" << '\n';
+    }
+  }
+
+  // Interior voxels can never be seen, only the rest is kept for rendering.
+  // The full set stays in `vertices` and `occupancy` for queries
+  void extract_surface() {
+    const auto xs = vertices.get_xs();
+    const auto ys = vertices.get_ys();
+    const auto zs = vertices.get_zs();
+    std::vector<uint8_t> exposed(vertices.size());
+
+    for (size_t i = 0; i < vertices.size(); ++i) {
+      int x = xs[i], y = ys[i], z = zs[i];
+      exposed[i] =
+          !(occupancy.has(x - 1, y, z) && occupancy.has(x + 1, y, z) &&
+            occupancy.has(x, y - 1, z) && occupancy.has(x, y + 1, z) &&
+            occupancy.has(x, y, z - 1) && occupancy.has(x, y, z + 1));
+    }
+
+    surface = vertices.select(exposed);
+
+    for (size_t i = 0; i < surface.size(); ++i) {
+      cv::Point3i p(surface.get_xs()[i], surface.get_ys()[i],
+                    surface.get_zs()[i]);
+      lower = i ? cv::Point3i(std::min(lower.x, p.x), std::min(lower.y, p.y),
+                              std::min(lower.z, p.z))
+                : p;
+      upper = i ? cv::Point3i(std::max(upper.x, p.x), std::max(upper.y, p.y),
+                              std::max(upper.z, p.z))
+                : p;
+    }
+
+    if (VERBOSITY >= 2) {
+      *log << "Culled " << vertices.size() - surface.size() << " of "
+                << vertices.size() << " voxels as interior" << '\n';
+    }
+  }
+
+  // Surface normals from the occupancy around every voxel: the sum of the
+  // directions to its 26 neighbours that are empty
+  void build_normals() {
+    PROFILE_SCOPE("Building normals");
+    normals.assign(1, std::vector<uint8_t>(surface.size()));
+
+    for (size_t i = 0; i < surface.size(); ++i) {
+      int x = surface.get_xs()[i], y = surface.get_ys()[i],
+          z = surface.get_zs()[i];
+      cv::Vec3f n;
+
+      for (int dz = -1; dz <= 1; ++dz) {
+        for (int dy = -1; dy <= 1; ++dy) {
+          for (int dx = -1; dx <= 1; ++dx) {
+            if ((dx || dy || dz) && !occupancy.has(x + dx, y + dy, z + dz)) {
+              n += cv::Vec3f(dx, dy, dz);
+            }
+          }
+        }
+      }
+
+      normals[0][i] = utils::encode_normal(n);
+    }
+  }
+
+  // Halves the surface until that stops removing voxels. Centered models
+  // end with the 2x2x2 voxels around the origin. Every coarse voxel gets the
+  // mean normal of the voxels it merged
+  void build_levels() {
+    PROFILE_SCOPE("Building detail levels");
+
+    while (true) {
+      const auto &finer = get_level(levels.size());
+      std::vector<unsigned> cell_of;
+      auto coarser = finer.downsample(&cell_of);
+      if (coarser.size() == finer.size()) {
+        break;
+      }
+
+      std::vector<cv::Vec3f> sums(coarser.size());
+      for (size_t i = 0; i < finer.size(); ++i) {
+        sums[cell_of[i]] += utils::decode_normal(normals.back()[i]);
+      }
+      std::vector<uint8_t> merged(coarser.size());
+      for (size_t i = 0; i < merged.size(); ++i) {
+        merged[i] = utils::encode_normal(sums[i]);
+      }
+
+      normals.push_back(std::move(merged));
+      levels.push_back(std::move(coarser));
+    }
+
+    if (VERBOSITY >= 3) {
+      *log << "Detail levels:";
+      for (size_t i = 0; i < get_level_count(); ++i) {
+        *log << ' ' << get_level(i).size();
+      }
+      *log << " voxels" << '\n';
+    }
+  }
+
+  // Every detail level sorted z major, then y, then x. Octant bits 0, 1, 2
+  // make x, y, z descending, so one of the eight orders visits the voxels
+  // front to back for any rotation
+  void build_orders() {
+    PROFILE_SCOPE("Building traversal orders");
+    orders.assign(get_level_count() * 8, std::vector<unsigned>());
+
+    for (size_t level = 0; level < get_level_count(); ++level) {
+      const auto &points = get_level(level);
+      const int16_t *coords[3] = {points.get_xs(), points.get_ys(),
+                                  points.get_zs()};
+
+      for (int octant = 0; octant < 8; ++octant) {
+        auto &order = orders[level * 8 + octant];
+        order.resize(points.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+          order[i] = (unsigned)i;
+        }
+
+        auto key = [&](unsigned v, int axis) {
+          return octant >> axis & 1 ? -coords[axis][v] : coords[axis][v];
+        };
+        std::sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+          for (int axis = 2; axis >= 0; --axis) {
+            if (key(a, axis) != key(b, axis)) {
+              return key(a, axis) < key(b, axis);
+            }
+          }
+          return false;
+        });
+      }
+    }
+  }
+
+  void build_spans() {
+    PROFILE_SCOPE("Building spans");
+    spans.clear();
+    for (size_t level = 0; level < get_level_count(); ++level) {
+      spans.emplace_back(get_level(level), normals[level].data());
+    }
+
+    if (VERBOSITY >= 3) {
+      const auto &full = spans.front();
+      *log << "Surface spans: " << full.size() << " runs for "
+                << full.voxel_count() << " voxels, " << full.memory()
+                << " bytes against " << full.voxel_count() * 7
+                << " as points" << '\n';
+    }
+  }
+
+  void build_bricks() {
+    PROFILE_SCOPE("Building bricks");
+    bricks = utils::brick_volume(surface, normals[0].data());
+
+    if (VERBOSITY >= 3) {
+      *log << "Surface bricks: " << bricks.brick_count() << ", "
+                << bricks.memory() << " bytes" << '\n';
+    }
+  }
+
+  // Attaches the record columns of the mapped file without copying them
+  void load_binary(const char *filename) {
+    auto model = voxfile::open_model(filename);
+
+    width = model.hdr->width;
+    height = model.hdr->height;
+    depth = model.hdr->depth;
+    center = cv::Point3f(width / 2, height / 2, depth / 2);
+
+    std::vector<unsigned> palette;
+    for (int i = 0; i < model.hdr->palette_size; ++i) {
+      auto entry = model.palette[i];
+      auto group = color_groups.find(entry.symbol);
+      palette.push_back(group != color_groups.end() ? group->second
+                                                    : entry.hue);
+    }
+
+    if (VERBOSITY >= 3) {
+      *log << "\nShape file size is " << model.file->size() << '\n';
+    }
+
+    vertices.attach(model.file, model.xs, model.ys, model.zs, model.color_ids,
+                    model.hdr->voxel_count, palette);
+  }
+
   utils::point_storage vertices;
+  utils::occupancy_volume occupancy;
+  utils::point_storage surface;
+  std::vector<utils::point_storage> levels; // Coarser copies of the surface
+  std::vector<std::vector<unsigned>> orders; // 8 per detail level
+  std::vector<utils::span_storage> spans;    // 1 per detail level
+  std::vector<std::vector<uint8_t>> normals; // 1 per detail level
+  utils::brick_volume bricks;
+  utils::color_lut color_table;
   color_pairs color_groups;
+  std::ostream *log; // Where loading reports progress
+  cv::Point3i lower;
+  cv::Point3i upper;
 };
 
-class Light : public Node {
-public:
-  Light(cv::Point3f position, float light_distance = 100.0f)
-      : Node(1, 1, 1, cv::Point3f()), light_distance(light_distance) {
-    translate(position);
+static const float ZBUFFER_DIVIDER = 100000.0f;
+static const int MAX_SPLAT_RADIUS = 4;
+static const int TILE_SIZE = 64;
+
+// Splats are 2 * radius + 1 pixels wide, the radius goes from 0 up to
+// MAX_SPLAT_RADIUS. It can change between frames, every splat function
+// dispatches to a kernel built for it
+int splat_radius = 2;
+
+// Whether the center of a voxel's splat is on the screen. Voxels whose
+// center falls outside of it are not drawn
+bool splat_center(float x, float y) {
+  return utils::in_range(x, 0.0f, (float)WIDTH) &&
+         utils::in_range(y, 0.0f, (float)HEIGHT);
+}
+
+// Calls fn(std::integral_constant<int, R>()) with R = splat_radius, so the
+// splat loops are compiled for every radius
+template <typename Fn> size_t with_splat_radius(Fn fn) {
+  switch (splat_radius) {
+  case 0:
+    return fn(std::integral_constant<int, 0>());
+  case 1:
+    return fn(std::integral_constant<int, 1>());
+  case 2:
+    return fn(std::integral_constant<int, 2>());
+  case 3:
+    return fn(std::integral_constant<int, 3>());
+  case 4:
+    return fn(std::integral_constant<int, 4>());
+  default:
+    std::cout << "Splat radius " << splat_radius << " is not in 0.."
+              << MAX_SPLAT_RADIUS << '\n';
+    exit(1);
   }
-  // cv::Vec3f dir;
-  // cv::Point3f pos;
-  // float fov;
+}
 
-  void scale() = delete;
-  float get_light_distance() const { return light_distance; }
+// Color of a voxel at the intensity its normal gets, full if unlit
+cv::Vec3b splat_color(const utils::color_lut &lut, int color_id,
+                      float intensity = 1.0f) {
+  return lut.at(color_id, intensity);
+}
 
-private:
-  float light_distance;
+// Transformed voxels of one frame
+struct screen_voxels {
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> depth;
+  const uint8_t *color_ids;
+  const unsigned *order = nullptr; // Drawing order, storage order if null
+  const uint8_t *normals = nullptr; // Encoded, per voxel
+  const float *shades = nullptr;    // Intensity per normal code, unlit if null
+  size_t size;
+  std::vector<uint8_t> expanded_ids;     // Backs color_ids for expanded spans
+  std::vector<uint8_t> expanded_normals; // Backs normals for expanded spans
+
+  size_t at(size_t i) const { return order ? order[i] : i; }
 };
 
-static const float ZBUFFER_DIVIDER = 100000.0f;
-
-void render_shape(cv::Mat &im, const Shape &shape) { //, const Light &cam) {
-  utils::Timer::start_measure("Clearing screen");
-  for (int y = 0; y < HEIGHT; ++y) { // Fill screen default color
-    for (int x = 0; x < WIDTH; ++x) {
-      *(im.ptr<cv::Vec3b>(y, x)) = BACKGROUND_COLOR;
+// True if every pixel of the inclusive [from_x, to_x] x [from_y, to_y]
+// footprint already holds something at least as near as `z`
+bool splat_occluded(const cv::Mat_<float> &z_buffer, int from_x, int from_y,
+                    int to_x, int to_y, float z) {
+  for (int sh = from_y; sh <= to_y; ++sh) {
+    auto depths = z_buffer.ptr<float>(sh);
+    for (int sw = from_x; sw <= to_x; ++sw) {
+      if (z > depths[sw]) {
+        return false;
+      }
     }
   }
-  utils::Timer::end_measure();
+  return true;
+}
 
-  cv::Mat_<float> z_buffer(HEIGHT, WIDTH, -1.0f);
+// Depth tests and fills `width` pixels of one splat row. The loop has no
+// branches, so it compiles to whole row loads and stores. Returns the pixels
+// written
+inline size_t fill_row(cv::Vec3b *row, float *depths, int width, float z,
+                       const cv::Vec3b &color) {
+  size_t written = 0;
+  for (int i = 0; i < width; ++i) {
+    bool nearer = z > depths[i];
+    depths[i] = nearer ? z : depths[i];
+    row[i] = nearer ? color : row[i];
+    written += nearer;
+  }
+  return written;
+}
 
-  // Transform each vertex according to its shape matrix
-  utils::Timer::start_measure("Transforming shape vertices");
-  auto vertcs = shape.get_vertices();
-  auto new_vex = vertcs.get_all();
+// Fills the splat of voxel `v` clipped to the inclusive [x0, x1] x [y0, y1].
+// The footprint is clipped once, unclipped rows have the compile time width
+// 2 * R + 1. Every pixel is depth tested on its own, splats that are fully
+// covered are skipped before their color is looked up. Returns the pixels
+// written
+template <int R>
+size_t fill_splat(cv::Mat &im, cv::Mat_<float> &z_buffer,
+                  const screen_voxels &voxels, size_t v,
+                  const utils::color_lut &lut, int x0, int y0, int x1,
+                  int y1) {
+  const int SIZE = 2 * R + 1;
+  float x = voxels.x[v], y = voxels.y[v];
+  int from_x = std::max((int)(x - R), x0);
+  int to_x = std::min((int)(x + R), x1);
+  int from_y = std::max((int)(y - R), y0);
+  int to_y = std::min((int)(y + R), y1);
+  auto z_val = voxels.depth[v] / ZBUFFER_DIVIDER;
+
+  if (from_x > to_x || from_y > to_y ||
+      splat_occluded(z_buffer, from_x, from_y, to_x, to_y, z_val)) {
+    return 0;
+  }
 
-  for (unsigned v = 0; v < new_vex.size(); ++v) {
-    auto vertex = new_vex[v];
-    auto vertex_as_vector = utils::p2v(vertex);
-    auto new_vertex =
-        shape.get_matx() * // utils::perspective(20.0, 20.0, -1, 5) *
-        vertex_as_vector;
-    auto homogeneous_coord = new_vertex.val[3];
+  auto color = splat_color(lut, voxels.color_ids[v],
+                           voxels.shades ? voxels.shades[voxels.normals[v]]
+                                         : 1.0f);
+  const int width = to_x - from_x + 1;
+  size_t written = 0;
+
+  for (int sh = from_y; sh <= to_y; ++sh) {
+    auto row = im.ptr<cv::Vec3b>(sh) + from_x;
+    auto depths = z_buffer.ptr<float>(sh) + from_x;
+    written += width == SIZE ? fill_row(row, depths, SIZE, z_val, color)
+                             : fill_row(row, depths, width, z_val, color);
+  }
+
+  return written;
+}
 
-    float x = new_vertex.val[0] / homogeneous_coord,
-          y = new_vertex.val[1] / homogeneous_coord,
-          z = new_vertex.val[2] / homogeneous_coord;
+// `z_buffer` is HEIGHT x WIDTH and carries depths over from earlier calls,
+// so several shapes can be drawn into one frame. Returns the pixels written
+size_t splat_serial(cv::Mat &im, const screen_voxels &voxels,
+                    const utils::color_lut &lut, cv::Mat_<float> &z_buffer) {
+  return with_splat_radius([&](auto radius) {
+    size_t written = 0;
 
-    int z_buffer_x_index = (int)x;
-    int z_buffer_y_index = (int)y;
+    for (size_t i = 0; i < voxels.size; ++i) {
+      size_t v = voxels.at(i);
 
-    if (z_buffer_x_index < 0 || z_buffer_x_index >= WIDTH) {
-      continue;
+      if (!splat_center(voxels.x[v], voxels.y[v])) {
+        // Skip out of bounds iteration
+        continue;
+      }
+
+      written += fill_splat<decltype(radius)::value>(
+          im, z_buffer, voxels, v, lut, 0, 0, WIDTH - 1, HEIGHT - 1);
     }
 
-    if (z_buffer_y_index < 0 || z_buffer_y_index >= HEIGHT) {
-      continue;
+    return written;
+  });
+}
+
+// Voxel indices of every screen tile, kept from frame to frame. The
+// indices of tile t are entries[starts[t], starts[t + 1])
+struct tile_bins {
+  std::vector<unsigned> starts;
+  std::vector<unsigned> entries;
+  std::vector<size_t> written; // Pixels written per tile
+};
+
+// Same result as splat_serial, split into TILE_SIZE screen tiles. Every
+// voxel is binned into each tile its splat overlaps and drawn clipped to it,
+// tiles own their pixels and run in parallel. Bins keep the drawing order,
+// so every pixel ends with the same color as in the serial path.
+//
+// Binning is a counting sort into `bins`, which only grows when a frame has
+// more voxels than any before
+size_t splat_tiled(cv::Mat &im, const screen_voxels &voxels,
+                   const utils::color_lut &lut, utils::worker_pool &pool,
+                   cv::Mat_<float> &z_buffer, tile_bins &bins) {
+  const int tiles_x = (WIDTH + TILE_SIZE - 1) / TILE_SIZE;
+  const int tiles_y = (HEIGHT + TILE_SIZE - 1) / TILE_SIZE;
+  const int tiles = tiles_x * tiles_y;
+  const int radius = splat_radius;
+
+  // A splat is never wider than a tile, so it lands in at most four
+  if (bins.entries.size() < voxels.size * 4) {
+    bins.entries.resize(voxels.size * 4);
+  }
+  bins.starts.assign(tiles + 1, 0);
+  bins.written.assign(tiles, 0);
+
+  auto for_each_tile = [&](size_t v, auto fn) {
+    float x = voxels.x[v], y = voxels.y[v];
+
+    if (!splat_center(x, y)) {
+      return;
     }
 
-    auto z_val = z /= ZBUFFER_DIVIDER;
-    auto z_buf_val = z_buffer.at<float>(z_buffer_x_index, z_buffer_y_index);
+    int from_x = std::max((int)(x - radius), 0) / TILE_SIZE;
+    int to_x = std::min((int)(x + radius), WIDTH - 1) / TILE_SIZE;
+    int from_y = std::max((int)(y - radius), 0) / TILE_SIZE;
+    int to_y = std::min((int)(y + radius), HEIGHT - 1) / TILE_SIZE;
 
-    if (utils::in_range<int>(x, 0, WIDTH) &&
-        utils::in_range<int>(y, 0, HEIGHT)) {
-      if (z_val > z_buf_val) {
-        z_buffer.at<float>(z_buffer_x_index, z_buffer_y_index) = z_val;
-      } else {
-        // Skip if this point behind another
-        continue;
+    for (int ty = from_y; ty <= to_y; ++ty) {
+      for (int tx = from_x; tx <= to_x; ++tx) {
+        fn(ty * tiles_x + tx);
+      }
+    }
+  };
+
+  for (size_t i = 0; i < voxels.size; ++i) {
+    for_each_tile(voxels.at(i), [&](int tile) { ++bins.starts[tile + 1]; });
+  }
+  for (int tile = 0; tile < tiles; ++tile) {
+    bins.starts[tile + 1] += bins.starts[tile];
+  }
+  for (size_t i = 0; i < voxels.size; ++i) {
+    size_t v = voxels.at(i);
+    // starts[t] runs ahead as tile t fills and ends at the start of t + 1
+    for_each_tile(v, [&](int tile) {
+      bins.entries[bins.starts[tile]++] = (unsigned)v;
+    });
+  }
+  for (int tile = tiles; tile > 0; --tile) {
+    bins.starts[tile] = bins.starts[tile - 1];
+  }
+  bins.starts[0] = 0;
+
+  with_splat_radius([&](auto radius) {
+    pool.run(tiles, [&](int tile) {
+      const int left = tile % tiles_x * TILE_SIZE;
+      const int top = tile / tiles_x * TILE_SIZE;
+      const int right = std::min(left + TILE_SIZE, WIDTH) - 1;
+      const int bottom = std::min(top + TILE_SIZE, HEIGHT) - 1;
+
+      for (unsigned e = bins.starts[tile]; e < bins.starts[tile + 1]; ++e) {
+        bins.written[tile] += fill_splat<decltype(radius)::value>(
+            im, z_buffer, voxels, bins.entries[e], lut, left, top, right,
+            bottom);
+      }
+    });
+    return (size_t)0;
+  });
+
+  size_t total = 0;
+  for (auto count : bins.written) {
+    total += count;
+  }
+  return total;
+}
+
+// Transforms every voxel of `points` by `matx` into `voxels`. Affine
+// matrices are stepped along the grid in `order` with RENDER_STEPPING, see
+// batch::transform_grid. `order` has to be sorted like one of the orders
+// of Shape::build_orders
+void transform_voxels(const cv::Matx44f &matx,
+                      const utils::point_storage &points,
+                      screen_voxels &voxels,
+                      const unsigned *order = nullptr) {
+  PROFILE_SCOPE("Transforming shape vertices");
+  voxels.size = points.size();
+  voxels.color_ids = points.get_color_ids();
+  voxels.x.resize(voxels.size);
+  voxels.y.resize(voxels.size);
+  voxels.depth.resize(voxels.size);
+
+  if (RENDER_STEPPING > 0 && order && batch::is_affine(matx)) {
+    batch::transform_grid(matx, points.get_xs(), points.get_ys(),
+                          points.get_zs(), order, voxels.size,
+                          voxels.x.data(), voxels.y.data(),
+                          voxels.depth.data(), RENDER_STEPPING == 2);
+  } else {
+    batch::transform(matx, points.get_xs(), points.get_ys(),
+                     points.get_zs(), voxels.size, voxels.x.data(),
+                     voxels.y.data(), voxels.depth.data());
+  }
+}
+
+// Expands the spans in the order of `octant` (see Shape::build_orders) into
+// `voxels`. The matrix is applied once per row, every span starts from the
+// row at its first voxel and steps along the x column of the matrix
+void transform_spans(const cv::Matx44f &matx, const utils::span_storage &spans,
+                     int octant, screen_voxels &voxels) {
+  PROFILE_SCOPE("Transforming shape spans");
+  voxels.size = spans.voxel_count();
+  voxels.order = nullptr;
+  voxels.x.resize(voxels.size);
+  voxels.y.resize(voxels.size);
+  voxels.depth.resize(voxels.size);
+  voxels.expanded_ids.resize(voxels.size);
+  voxels.color_ids = voxels.expanded_ids.data();
+  voxels.expanded_normals.resize(voxels.size);
+  voxels.normals = voxels.expanded_normals.data();
+
+  const bool x_down = octant & 1, y_down = octant & 2, z_down = octant & 4;
+  // Without perspective w stays 1 and the divide is skipped
+  const bool affine = matx(3, 0) == 0 && matx(3, 1) == 0 &&
+                      matx(3, 2) == 0 && matx(3, 3) == 1;
+  const float sign = x_down ? -1.0f : 1.0f;
+  const cv::Vec4f step(matx(0, 0) * sign, matx(1, 0) * sign,
+                       matx(2, 0) * sign, matx(3, 0) * sign);
+  const auto &all = spans.get_spans();
+  size_t out = 0;
+
+  auto expand = [&](const utils::voxel_span &span, const cv::Vec4f &row) {
+    const int length = span.length;
+    const float first = x_down ? span.x + length - 1 : span.x;
+    float from[4];
+    for (int k = 0; k < 4; ++k) {
+      from[k] = row[k] + matx(k, 0) * first;
+    }
+
+    float *xs = &voxels.x[out], *ys = &voxels.y[out];
+    float *depths = &voxels.depth[out];
+    if (affine) {
+      for (int i = 0; i < length; ++i) {
+        xs[i] = from[0] + step[0] * i;
+        ys[i] = from[1] + step[1] * i;
+        depths[i] = from[2] + step[2] * i;
       }
     } else {
-      // Skip out of bounds iteration
-      continue;
+      for (int i = 0; i < length; ++i) {
+        float w = from[3] + step[3] * i;
+        xs[i] = (from[0] + step[0] * i) / w;
+        ys[i] = (from[1] + step[1] * i) / w;
+        depths[i] = (from[2] + step[2] * i) / w;
+      }
     }
+    std::fill_n(&voxels.expanded_ids[out], length, span.color_id);
+    std::fill_n(&voxels.expanded_normals[out], length, span.normal);
+    out += length;
+  };
+
+  const size_t slices = spans.slice_count();
+  for (size_t s = 0; s < slices; ++s) {
+    size_t slice = z_down ? slices - 1 - s : s;
+    unsigned row_from = spans.slice_begin(slice),
+             rows = spans.slice_end(slice) - row_from;
+
+    for (unsigned r = 0; r < rows; ++r) {
+      unsigned row = row_from + (y_down ? rows - 1 - r : r);
+      unsigned span_from = spans.row_begin(row),
+               count = spans.row_end(row) - span_from;
+
+      // The row at x = 0
+      const auto &head = all[span_from];
+      cv::Vec4f origin;
+      for (int k = 0; k < 4; ++k) {
+        origin[k] = matx(k, 1) * head.y + matx(k, 2) * head.z + matx(k, 3);
+      }
 
-    // float distance_to = cv::norm(cam.get_pos() - cv::Point3f(x, y, z));
-    float color_intensity;
+      for (unsigned i = 0; i < count; ++i) {
+        expand(all[span_from + (x_down ? count - 1 - i : i)], origin);
+      }
+    }
+  }
+}
 
-    // if (distance_to <= 0.0f) {
-    //   color_intensity = 1.0f;
-    // } else if (distance_to >= cam.get_light_distance()) {
-    //   color_intensity = 0.0f;
-    // } else {
-    //   color_intensity = utils::clamp((cam.get_light_distance() -
-    //   distance_to),
-    //                                  0.0f, cam.get_light_distance()) /
-    //                     cam.get_light_distance();
-    // }
+// Coarsest detail level whose neighbouring voxels are still at most a splat
+// width apart on screen, so the model is drawn with about one voxel per splat
+size_t lod_level(const cv::Matx44f &matx, size_t levels) {
+  float spacing = 0;
+  for (int c = 0; c < 3; ++c) {
+    spacing = std::max(spacing, std::sqrt(matx(0, c) * matx(0, c) +
+                                          matx(1, c) * matx(1, c)));
+  }
 
-    color_intensity = 1.0f; // Override
-    // std::cout << "ci " << color_intensity << '\n';
+  size_t level = 0;
+  while (level + 1 < levels &&
+         spacing * (2 << level) <= 2 * splat_radius + 1) {
+    ++level;
+  }
+  return level;
+}
 
-    const int &hue = vertcs.get_color(v);
+// Places the voxels of a detail level at the center of the full resolution
+// block each of them stands for
+cv::Matx44f lod_matx(const cv::Matx44f &matx, size_t level) {
+  if (level == 0) {
+    return matx;
+  }
 
-    // utils::Timer::start_measure("Splat drawing");
-    // Check if is not out of bounds
-    for (int sh = y - 2; sh <= y + 2; ++sh) {
-      for (int sw = x - 2; sw <= x + 2; ++sw) {
+  float size = (float)(1 << level);
+  float offset = (size - 1) / 2;
+  return matx * utils::translate(offset, offset, offset) *
+         utils::scale(size, size, size);
+}
 
-        if (utils::in_range<int>(sw, 0, WIDTH) &&
-            utils::in_range<int>(sh, 0, HEIGHT)) {
+// Octant whose traversal order runs front to back under `matx`. Bit 0, 1, 2
+// set means descending x, y, z, larger depth is nearer
+int view_octant(const cv::Matx44f &matx) {
+  return (matx(2, 0) > 0 ? 1 : 0) | (matx(2, 1) > 0 ? 2 : 0) |
+         (matx(2, 2) > 0 ? 4 : 0);
+}
 
-          im.at<cv::Vec3b>(sh, sw) = utils::HSVtoBGR(
-              cv::Vec3f(hue, 100 * color_intensity, 100 * color_intensity));
-        }
-      }
-      // utils::hsl2bgr(cv::Vec3b(360, 100, color_intensity * 255));
+// Transforms the detail level of `shape` that suits `matx` and orders it
+// front to back. `shades` from shade_table lights the voxels
+void transform_shape(const Shape &shape, const cv::Matx44f &matx,
+                     screen_voxels &voxels, const float *shades = nullptr) {
+  size_t level = lod_level(matx, shape.get_level_count());
+
+  if (RENDER_SPANS) {
+    transform_spans(lod_matx(matx, level), shape.get_spans(level),
+                    view_octant(matx), voxels);
+  } else {
+    const unsigned *order = shape.get_order(level, view_octant(matx)).data();
+    transform_voxels(lod_matx(matx, level), shape.get_level(level), voxels,
+                     order);
+    voxels.order = order;
+    voxels.normals = shape.get_normals(level).data();
+  }
+  voxels.shades = shades;
+}
+
+int render_threads() {
+  return RENDER_THREADS > 0 ? RENDER_THREADS
+                            : (int)std::thread::hardware_concurrency();
+}
+
+// Screen area the last frame drew into, so the next frame only has to clear
+// and redraw the union of the old and new areas
+struct redraw_region {
+  cv::Rect drawn;            // Splat bounds of the last frame, empty if none
+  size_t redrawn_pixels = 0; // Pixels cleared and redrawn by the last frame
+  bool full = true;          // Next frame redraws the whole screen
+};
+
+// Bounds of every splat that is drawn, clipped to the drawable area
+cv::Rect screen_bounds(const screen_voxels &voxels) {
+  int x0 = WIDTH, y0 = HEIGHT, x1 = -1, y1 = -1;
+
+  for (size_t v = 0; v < voxels.size; ++v) {
+    if (splat_center(voxels.x[v], voxels.y[v])) {
+      x0 = std::min(x0, (int)(voxels.x[v] - splat_radius));
+      x1 = std::max(x1, (int)(voxels.x[v] + splat_radius));
+      y0 = std::min(y0, (int)(voxels.y[v] - splat_radius));
+      y1 = std::max(y1, (int)(voxels.y[v] + splat_radius));
     }
-    // utils::Timer::end_measure();
+  }
 
-    //   if (VERBOSITY >= 4) {
-    //     std::cout << "Previous: " << vertex << " next: " << end_point <<
-    //     '\n';
-    //   }
+  if (x1 < 0) {
+    return cv::Rect();
   }
-  utils::Timer::end_measure();
 
-  cv::imshow(MAIN_WINDOW_NAME, im);
+  x0 = std::max(x0, 0);
+  y0 = std::max(y0, 0);
+  x1 = std::min(x1, WIDTH - 1);
+  y1 = std::min(y1, HEIGHT - 1);
+  return cv::Rect(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+}
+
+// Everything drawing a frame needs, kept from frame to frame: the color and
+// depth buffers, what was last drawn into them, and scratch space for the
+// voxels, tile bins, shades and render threads. Once it has held the
+// largest frame, drawing into it makes no heap allocation
+struct RenderTarget {
+  // Draws into the pixels of `image`, which is HEIGHT x WIDTH
+  explicit RenderTarget(const cv::Mat &image = cv::Mat(
+                            HEIGHT, WIDTH, CV_8UC3,
+                            (cv::Scalar)BACKGROUND_COLOR))
+      : image(image), depth(HEIGHT, WIDTH, -1.0f), pool(render_threads()) {}
+
+  RenderTarget(const RenderTarget &) = delete;
+  RenderTarget &operator=(const RenderTarget &) = delete;
+
+  cv::Mat image;
+  cv::Mat_<float> depth;
+  redraw_region region; // What `image` holds
+  screen_voxels voxels;
+  tile_bins bins;
+  std::vector<unsigned> visible;    // Scene instances on screen
+  std::vector<cv::Vec2i> row_spans; // Columns a cast ray can hit, per row
+  shade_table shading;              // Of the last shape drawn with a light
+  utils::worker_pool pool;
+};
+
+// Resets color and depth of `area`
+void clear_target(RenderTarget &target, const cv::Rect &area) {
+  PROFILE_SCOPE("Clearing screen");
+  for (int y = area.y; y < area.y + area.height; ++y) {
+    auto row = target.image.ptr<cv::Vec3b>(y);
+    auto depths = target.depth.ptr<float>(y);
+    for (int x = area.x; x < area.x + area.width; ++x) {
+      row[x] = BACKGROUND_COLOR;
+      depths[x] = -1.0f;
+    }
+  }
+}
+
+// Splats the voxels of the target, on its threads if it has more than one
+size_t splat_target(RenderTarget &target, const utils::color_lut &lut) {
+  PROFILE_SCOPE("Splat drawing");
+  if (target.pool.size() > 1) {
+    return splat_tiled(target.image, target.voxels, lut, target.pool,
+                       target.depth, target.bins);
+  }
+  return splat_serial(target.image, target.voxels, lut, target.depth);
+}
+
+// Renders the shape into the target without showing it. Only the part of
+// the screen covered by this or the previous frame of the target is
+// touched. All voxels are drawn at full intensity without a `light`
+void draw_shape(RenderTarget &target, const Shape &shape,
+                const Light *light = nullptr) {
+  PROFILE_SCOPE("Drawing shape");
+
+  // Transform each vertex according to its shape matrix
+  transform_shape(shape, shape.get_matx(), target.voxels,
+                  light ? target.shading.lookup(shape, *light) : nullptr);
+
+  auto &region = target.region;
+  const cv::Rect bounds = screen_bounds(target.voxels);
+  const cv::Rect dirty =
+      region.full ? cv::Rect(0, 0, WIDTH, HEIGHT) : (region.drawn | bounds);
+
+  // Every splat lies within `bounds`, depths outside of `dirty` are never
+  // read
+  clear_target(target, dirty);
+
+  region.drawn = bounds;
+  region.redrawn_pixels = dirty.area();
+  region.full = false;
+
+  splat_target(target, shape.get_color_lut());
+}
+
+#ifndef HEADLESS
+// HighGUI has no partial window update, a frame that redrew nothing is not
+// shown again
+void render_shape(RenderTarget &target, const Shape &shape,
+                  const Light *light = nullptr) {
+  draw_shape(target, shape, light);
+  if (target.region.redrawn_pixels > 0) {
+    cv::imshow(MAIN_WINDOW_NAME, target.image);
+  }
 }
+#endif
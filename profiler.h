@@ -0,0 +1,318 @@
+#pragma once
+
+#include "includes.h"
+#include "settings.h"
+
+#include <chrono>
+#include <cstring>
+#include <mutex>
+
+// Scoped wall-clock profiler. PROFILE_SCOPE("name") measures until the end
+// of the enclosing block. Scopes nest and can run on any thread, each thread
+// records into its own log so the hot path takes only an uncontended lock.
+//
+// Collected scopes can be printed as per-name statistics with report() or
+// written as Chrome trace events (chrome://tracing, Perfetto) with
+// write_trace(). Defining PROFILER_DISABLED compiles every scope out,
+// TIME_MEASURE turns them off at runtime.
+//
+// Scope names are interned once per call site and every thread reserves its
+// storage when it first records, so timing a scope allocates nothing after
+// that.
+namespace profiler {
+
+typedef std::chrono::steady_clock clock;
+
+const size_t MAX_EVENTS = 1 << 20; // Trace events kept per thread
+const int MAX_SCOPE_NAMES = 256;
+
+// Prints every scope of the main thread as it ends, nested ones indented
+bool live_output = VERBOSITY >= 4;
+
+struct event {
+  const char *name;
+  int64_t start_us; // Since the profiler epoch
+  int64_t duration_us;
+  int depth;
+};
+
+struct stats {
+  uint64_t count = 0;
+  double total_ms = 0;
+  double min_ms = 1e30;
+  double max_ms = 0;
+
+  void add(double ms) {
+    ++count;
+    total_ms += ms;
+    min_ms = std::min(min_ms, ms);
+    max_ms = std::max(max_ms, ms);
+  }
+
+  void add(const stats &other) {
+    count += other.count;
+    total_ms += other.total_ms;
+    min_ms = std::min(min_ms, other.min_ms);
+    max_ms = std::max(max_ms, other.max_ms);
+  }
+};
+
+// Interned scope name
+struct site {
+  int id;
+  const char *name;
+};
+
+struct thread_log {
+  // Reserved up front, pages of `events` are only touched once written
+  thread_log() : scopes(MAX_SCOPE_NAMES) { events.reserve(MAX_EVENTS); }
+
+  std::mutex lock; // Guards events and scopes against report() readers
+  int id = 0;
+  int depth = 0; // Only touched by the owning thread
+  std::vector<event> events;
+  std::vector<stats> scopes; // By name id
+};
+
+// Logs of running threads plus everything left behind by finished ones
+struct registry {
+  std::mutex lock;
+  clock::time_point epoch = clock::now();
+  std::vector<std::shared_ptr<thread_log>> threads;
+  std::vector<int> free_ids; // Ids of finished threads, reused by new ones
+  int next_id = 0;
+  std::vector<std::pair<int, event>> retired_events;
+  std::map<std::string, stats> retired_scopes;
+  std::vector<const char *> names; // Interned, by id
+};
+
+registry &global() {
+  static registry r;
+  return r;
+}
+
+// Id of the scope name, the same for every site with that name
+site intern(const char *name) {
+  auto &r = global();
+  std::lock_guard<std::mutex> guard(r.lock);
+
+  for (size_t i = 0; i < r.names.size(); ++i) {
+    if (std::strcmp(r.names[i], name) == 0) {
+      return {(int)i, r.names[i]};
+    }
+  }
+
+  if ((int)r.names.size() == MAX_SCOPE_NAMES) {
+    std::cout << "More than " << MAX_SCOPE_NAMES << " profiler scope names"
+              << '\n';
+    exit(1);
+  }
+  r.names.push_back(name);
+  return {(int)r.names.size() - 1, name};
+}
+
+// Adds the recorded names of `scopes` into `res` by name, under the
+// registry lock
+void add_scopes(const std::vector<stats> &scopes,
+                std::map<std::string, stats> &res) {
+  const auto &names = global().names;
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (scopes[i].count > 0) {
+      res[names[i]].add(scopes[i]);
+    }
+  }
+}
+
+// Moves a finished thread's records into the registry
+void retire(const std::shared_ptr<thread_log> &log) {
+  auto &r = global();
+  std::lock_guard<std::mutex> guard(r.lock);
+
+  for (const auto &e : log->events) {
+    if (r.retired_events.size() < MAX_EVENTS) {
+      r.retired_events.emplace_back(log->id, e);
+    }
+  }
+  add_scopes(log->scopes, r.retired_scopes);
+
+  r.threads.erase(std::find(r.threads.begin(), r.threads.end(), log));
+  r.free_ids.push_back(log->id);
+}
+
+struct thread_slot {
+  std::shared_ptr<thread_log> log;
+  ~thread_slot() {
+    if (log) {
+      retire(log);
+    }
+  }
+};
+
+thread_log &local() {
+  thread_local thread_slot slot;
+
+  if (!slot.log) {
+    slot.log = std::make_shared<thread_log>();
+
+    auto &r = global();
+    std::lock_guard<std::mutex> guard(r.lock);
+    if (r.free_ids.empty()) {
+      slot.log->id = r.next_id++;
+    } else {
+      slot.log->id = r.free_ids.back();
+      r.free_ids.pop_back();
+    }
+    r.threads.push_back(slot.log);
+  }
+
+  return *slot.log;
+}
+
+const char *rating(double ms) {
+  if (ms < 6.0) {
+    return "\e[96mLIGHTNING FAST\e[39m";
+  } else if (ms < 30.0) {
+    return "\e[92mFAST\e[39m";
+  } else if (ms < 100.0) {
+    return "\e[93mMODERATE\e[39m";
+  } else if (ms < 160.0) {
+    return "\e[95mSLOW\e[39m";
+  } else if (ms < 250.0) {
+    return "\e[91mVERY SLOW\e[39m";
+  }
+  return "\e[31mBLOCKING\e[39m";
+}
+
+class scope {
+public:
+  explicit scope(const site &at) : at(at) {
+    if (!TIME_MEASURE) {
+      return;
+    }
+
+    log = &local();
+    ++log->depth;
+    start = clock::now();
+  }
+
+  ~scope() {
+    if (!TIME_MEASURE) {
+      return;
+    }
+
+    auto end = clock::now();
+    int depth = --log->depth;
+    double ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+    {
+      std::lock_guard<std::mutex> guard(log->lock);
+      log->scopes[at.id].add(ms);
+
+      if (log->events.size() < MAX_EVENTS) {
+        auto since = [](clock::time_point t) {
+          return std::chrono::duration_cast<std::chrono::microseconds>(
+                     t - global().epoch)
+              .count();
+        };
+        log->events.push_back(
+            {at.name, since(start), since(end) - since(start), depth});
+      }
+    }
+
+    if (live_output && log->id == 0) {
+      for (int i = 0; i < depth; ++i) {
+        std::cout << "  ";
+      }
+      std::cout << "\e[32mTIME:\e[39m '" << at.name << "' took " << ms
+                << "ms. (" << rating(ms) << ")" << '\n';
+    }
+  }
+
+  scope(const scope &) = delete;
+  scope &operator=(const scope &) = delete;
+
+private:
+  site at;
+  thread_log *log = nullptr;
+  clock::time_point start;
+};
+
+// Per-name statistics over every thread
+std::map<std::string, stats> collect() {
+  auto &r = global();
+  std::lock_guard<std::mutex> guard(r.lock);
+  auto res = r.retired_scopes;
+
+  for (const auto &log : r.threads) {
+    std::lock_guard<std::mutex> log_guard(log->lock);
+    add_scopes(log->scopes, res);
+  }
+
+  return res;
+}
+
+void report(std::ostream &out) {
+  auto scopes = collect();
+  std::vector<std::pair<std::string, stats>> sorted(scopes.begin(),
+                                                    scopes.end());
+  std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+    return a.second.total_ms > b.second.total_ms;
+  });
+
+  out << "\nProfile (scope: count, total, mean, min, max in ms)\n";
+  for (const auto &s : sorted) {
+    out << "  " << s.first << ": " << s.second.count << ", "
+        << s.second.total_ms << ", " << s.second.total_ms / s.second.count
+        << ", " << s.second.min_ms << ", " << s.second.max_ms << '\n';
+  }
+}
+
+// Writes every recorded scope as a Chrome trace "complete" event
+bool write_trace(const char *filename) {
+  std::ofstream out(filename);
+  if (!out) {
+    return false;
+  }
+
+  auto write = [&](int tid, const event &e, bool first) {
+    out << (first ? "\n" : ",\n") << "{\"name\": \"" << e.name
+        << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << tid
+        << ", \"ts\": " << e.start_us << ", \"dur\": " << e.duration_us
+        << "}";
+  };
+
+  auto &r = global();
+  std::lock_guard<std::mutex> guard(r.lock);
+  bool first = true;
+
+  out << "{\"traceEvents\": [";
+  for (const auto &e : r.retired_events) {
+    write(e.first, e.second, first);
+    first = false;
+  }
+  for (const auto &log : r.threads) {
+    std::lock_guard<std::mutex> log_guard(log->lock);
+    for (const auto &e : log->events) {
+      write(log->id, e, first);
+      first = false;
+    }
+  }
+  out << "\n]}\n";
+
+  return (bool)out;
+}
+
+} // namespace profiler
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#ifdef PROFILER_DISABLED
+#define PROFILE_SCOPE(name)
+#else
+#define PROFILE_SCOPE(name)                                                    \
+  static const profiler::site PROFILE_CONCAT(profile_site_, __LINE__) =        \
+      profiler::intern(name);                                                  \
+  profiler::scope PROFILE_CONCAT(profile_scope_, __LINE__)(                    \
+      PROFILE_CONCAT(profile_site_, __LINE__))
+#endif
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "includes.h"
+#include "node.h"
+#include "profiler.h"
+#include "settings.h"
+#include "utils.h"
+
+// Renders a shape by casting one ray per pixel into its surface bricks
+// instead of splatting every voxel, so the cost follows the covered pixels
+// rather than the voxel count.
+//
+// The projection is orthographic: every ray runs along the screen z axis,
+// through the pixel center, from the front (larger depth) backwards. The
+// matrix of the shape maps it into voxel space, where it is walked brick by
+// brick, empty bricks are crossed in one step. Within an occupied brick it
+// steps from voxel to voxel (3D DDA) until it hits one.
+
+// Casts a ray for every pixel the shape can cover into the target, rows in
+// parallel on the target's threads. Only the area of the last frame and the
+// box of this one are cleared, the depth buffer receives the depth of the
+// center of every voxel hit like a splatted frame, so both modes can take
+// turns on one target and mix in one frame
+void cast_shape(RenderTarget &target, const Shape &shape,
+                const Light *light = nullptr) {
+  PROFILE_SCOPE("Casting shape");
+
+  const auto &volume = shape.get_bricks();
+  const auto &lut = shape.get_color_lut();
+  const float *shades =
+      light ? target.shading.lookup(shape, *light) : nullptr;
+  const cv::Matx44f &m = shape.get_matx();
+  const cv::Matx44f inv = utils::affine_inverse(m);
+
+  // Screen rectangle of the volume's box
+  const auto lower = volume.get_lower(), size = volume.get_size();
+  int x0 = WIDTH, y0 = HEIGHT, x1 = -1, y1 = -1;
+  for (int corner = 0; corner < 8; ++corner) {
+    cv::Vec4f p(lower.x - 0.5f + (corner & 1 ? size.x : 0),
+                lower.y - 0.5f + (corner & 2 ? size.y : 0),
+                lower.z - 0.5f + (corner & 4 ? size.z : 0), 1.0f);
+    cv::Vec4f t = m * p;
+    x0 = std::min(x0, (int)std::floor(t[0]));
+    y0 = std::min(y0, (int)std::floor(t[1]));
+    x1 = std::max(x1, (int)std::ceil(t[0]));
+    y1 = std::max(y1, (int)std::ceil(t[1]));
+  }
+  x0 = std::max(x0, 0);
+  y0 = std::max(y0, 0);
+  x1 = std::min(x1, WIDTH - 1);
+  y1 = std::min(y1, HEIGHT - 1);
+
+  const cv::Rect bounds = volume.brick_count() == 0 || x0 > x1 || y0 > y1
+                             ? cv::Rect()
+                             : cv::Rect(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+  auto &region = target.region;
+  const cv::Rect dirty =
+      region.full ? cv::Rect(0, 0, WIDTH, HEIGHT) : (region.drawn | bounds);
+  clear_target(target, dirty);
+
+  region.drawn = bounds;
+  region.redrawn_pixels = dirty.area();
+  region.full = false;
+  if (bounds.area() == 0) {
+    return;
+  }
+
+  // Screen (x, y, depth) maps to voxel space as base + x * ax + y * ay +
+  // depth * az, shifted so voxel centers sit in the middle of their cells
+  const cv::Vec3f az(inv(0, 2), inv(1, 2), inv(2, 2));
+  const cv::Vec3f ax(inv(0, 0), inv(1, 0), inv(2, 0));
+  const cv::Vec3f ay(inv(0, 1), inv(1, 1), inv(2, 1));
+  const cv::Vec3f base(inv(0, 3) - lower.x + 0.5f, inv(1, 3) - lower.y + 0.5f,
+                       inv(2, 3) - lower.z + 0.5f);
+  const int B = utils::brick_volume::BRICK;
+
+  // Screen depth of the center of cell (x, y, z), the depth the voxel gets
+  // when splatted. The ray enters the cell up to half a cell nearer
+  const cv::Vec4f center_depth(m(2, 0), m(2, 1), m(2, 2),
+                               m(2, 3) + m(2, 0) * lower.x +
+                                   m(2, 1) * lower.y + m(2, 2) * lower.z);
+
+  // Rays only start where an occupied brick projects to, which leaves out
+  // the empty corners of the box and the gaps of sparse shapes
+  auto &spans = target.row_spans;
+  spans.assign(HEIGHT, cv::Vec2i(WIDTH, -1));
+  const auto bricks = volume.get_bricks();
+  for (int bz = 0; bz < bricks.z; ++bz) {
+    for (int by = 0; by < bricks.y; ++by) {
+      for (int bx = 0; bx < bricks.x; ++bx) {
+        if (volume.brick(bx, by, bz) == utils::brick_volume::EMPTY) {
+          continue;
+        }
+
+        float bx0 = 1e30f, by0 = 1e30f, bx1 = -1e30f, by1 = -1e30f;
+        for (int corner = 0; corner < 8; ++corner) {
+          cv::Vec4f p(lower.x - 0.5f + (bx + (corner & 1)) * B,
+                      lower.y - 0.5f + (by + (corner >> 1 & 1)) * B,
+                      lower.z - 0.5f + (bz + (corner >> 2)) * B, 1.0f);
+          cv::Vec4f t = m * p;
+          bx0 = std::min(bx0, t[0]);
+          bx1 = std::max(bx1, t[0]);
+          by0 = std::min(by0, t[1]);
+          by1 = std::max(by1, t[1]);
+        }
+
+        const int from = std::max(x0, (int)std::floor(bx0));
+        const int to = std::min(x1, (int)std::ceil(bx1));
+        const int top = std::max(y0, (int)std::floor(by0));
+        const int bottom = std::min(y1, (int)std::ceil(by1));
+        for (int y = top; y <= bottom; ++y) {
+          spans[y][0] = std::min(spans[y][0], from);
+          spans[y][1] = std::max(spans[y][1], to);
+        }
+      }
+    }
+  }
+
+  target.pool.run(y1 - y0 + 1, [&](int row) {
+    const int y = y0 + row;
+    auto pixels = target.image.ptr<cv::Vec3b>(y);
+    auto depths = target.depth.ptr<float>(y);
+
+    utils::grid_ray ray;
+    ray.dir = az * -1.0f;
+    for (int x = spans[y][0]; x <= spans[y][1]; ++x) {
+      ray.origin = base + ax * (x + 0.5f) + ay * (y + 0.5f);
+
+      uint32_t slot;
+      cv::Vec3i cell;
+      float s;
+      if (!utils::cast_ray(volume, ray, slot, cell, s)) {
+        continue;
+      }
+
+      int lx = cell[0] % B, ly = cell[1] % B, lz = cell[2] % B;
+      float intensity =
+          shades ? shades[volume.normal(slot, lx, ly, lz)] : 1.0f;
+      pixels[x] = splat_color(lut, volume.color_id(slot, lx, ly, lz),
+                              intensity);
+      depths[x] = (center_depth[0] * cell[0] + center_depth[1] * cell[1] +
+                   center_depth[2] * cell[2] + center_depth[3]) /
+                  ZBUFFER_DIVIDER;
+    }
+  });
+}
+
+#ifndef HEADLESS
+void render_shape_cast(RenderTarget &target, const Shape &shape,
+                       const Light *light = nullptr) {
+  cast_shape(target, shape, light);
+  if (target.region.redrawn_pixels > 0) {
+    cv::imshow(MAIN_WINDOW_NAME, target.image);
+  }
+}
+#endif
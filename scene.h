@@ -0,0 +1,302 @@
+#pragma once
+
+#include "includes.h"
+#include "node.h"
+#include "profiler.h"
+#include "settings.h"
+
+#include <deque>
+
+// Many placed copies of a few loaded shapes. Every Instance has its own
+// transform and refers to the voxel data of its Shape, which is never
+// modified and never copied.
+//
+// Instances are culled against the screen before any of their voxels are
+// transformed. Their screen bounds are kept in a bounding volume hierarchy
+// that is rebuilt when instances are added and refit when they move.
+class Instance : public Node {
+public:
+  explicit Instance(std::shared_ptr<const Shape> shape)
+      : Node(shape->get_width(), shape->get_height(), shape->get_depth()),
+        shape(std::move(shape)) {}
+
+  const Shape &get_shape() const { return *shape; }
+  // Intensities of the shape's encoded normals under `light` for this copy
+  const float *get_shades(const Light &light) const {
+    return shading.lookup(*this, light);
+  }
+
+private:
+  std::shared_ptr<const Shape> shape;
+  mutable shade_table shading;
+};
+
+// Axis aligned screen rectangle, inclusive
+struct screen_box {
+  float x0 = 0, y0 = 0, x1 = -1, y1 = -1;
+
+  bool overlaps(const screen_box &other) const {
+    return x0 <= other.x1 && other.x0 <= x1 && y0 <= other.y1 &&
+           other.y0 <= y1;
+  }
+
+  screen_box &grow(const screen_box &other) {
+    x0 = std::min(x0, other.x0);
+    y0 = std::min(y0, other.y0);
+    x1 = std::max(x1, other.x1);
+    y1 = std::max(y1, other.y1);
+    return *this;
+  }
+};
+
+// Screen bounds of every splat the instance can draw: the corners of the
+// model's voxel box under the instance matrix, padded by the largest splat
+// radius. A voxel of detail level L sits at the center of its 2^L block
+// (see lod_matx), up to (2^L - 1) / 2 voxels outside of the box. The box
+// grows by that for the coarsest level before it is transformed, so the
+// pad follows the instance's scale and rotation
+screen_box instance_box(const Instance &instance) {
+  const auto &m = instance.get_matx();
+  const auto &shape = instance.get_shape();
+  const float spill = ((1 << (shape.get_level_count() - 1)) - 1) / 2.0f;
+  const cv::Point3f lower = cv::Point3f(shape.get_lower()) -
+                            cv::Point3f(spill, spill, spill);
+  const cv::Point3f upper = cv::Point3f(shape.get_upper()) +
+                            cv::Point3f(spill, spill, spill);
+  screen_box box;
+
+  for (int corner = 0; corner < 8; ++corner) {
+    cv::Vec4f p(corner & 1 ? upper.x : lower.x, corner & 2 ? upper.y : lower.y,
+                corner & 4 ? upper.z : lower.z, 1.0f);
+    cv::Vec4f t = m * p;
+    float x = t[0] / t[3], y = t[1] / t[3];
+
+    screen_box point;
+    point.x0 = point.x1 = x;
+    point.y0 = point.y1 = y;
+    if (corner == 0) {
+      box = point;
+    } else {
+      box.grow(point);
+    }
+  }
+
+  // Splats reach the radius past their center pixel, which truncates
+  const float pad = MAX_SPLAT_RADIUS + 1;
+  box.x0 -= pad;
+  box.y0 -= pad;
+  box.x1 += pad;
+  box.y1 += pad;
+  return box;
+}
+
+class Scene {
+public:
+  static const int LEAF_SIZE = 4; // Instances per BVH leaf
+
+  // Places a new copy of `shape`, it starts at the origin like a Shape
+  Instance &add(std::shared_ptr<const Shape> shape) {
+    instances.emplace_back(std::move(shape));
+    built = false;
+    return instances.back();
+  }
+
+  Instance &at(size_t index) { return instances[index]; }
+  const Instance &at(size_t index) const { return instances[index]; }
+  size_t size() const { return instances.size(); }
+
+  // Indices of the instances that overlap `area`, in the order they were
+  // added, into `res`. Allocates nothing once `res` has held every instance
+  void visible(const screen_box &area, std::vector<unsigned> &res) const {
+    PROFILE_SCOPE("Culling instances");
+    update();
+
+    res.clear();
+    res.reserve(instances.size());
+    if (nodes.empty()) {
+      return;
+    }
+
+    stack.clear();
+    stack.push_back(0);
+    while (!stack.empty()) {
+      const auto &node = nodes[stack.back()];
+      stack.pop_back();
+
+      if (!node.box.overlaps(area)) {
+        continue;
+      }
+
+      if (node.count > 0) {
+        for (unsigned i = node.first; i < node.first + node.count; ++i) {
+          if (boxes[order[i]].overlaps(area)) {
+            res.push_back(order[i]);
+          }
+        }
+      } else {
+        stack.push_back(node.first);
+        stack.push_back(node.first + 1);
+      }
+    }
+
+    std::sort(res.begin(), res.end());
+  }
+
+  std::vector<unsigned> visible(const screen_box &area) const {
+    std::vector<unsigned> res;
+    visible(area, res);
+    return res;
+  }
+
+private:
+  // Leaves cover order[first, first + count), inner nodes have count 0 and
+  // their children at nodes[first] and nodes[first + 1]
+  struct bvh_node {
+    screen_box box;
+    unsigned first = 0;
+    unsigned count = 0;
+  };
+
+  // Refreshes the boxes of moved instances and rebuilds or refits the tree
+  void update() const {
+    bool moved = false;
+    boxes.resize(instances.size());
+    revisions.resize(instances.size(), (uint64_t)-1);
+
+    for (size_t i = 0; i < instances.size(); ++i) {
+      if (revisions[i] != instances[i].get_revision()) {
+        revisions[i] = instances[i].get_revision();
+        boxes[i] = instance_box(instances[i]);
+        moved = true;
+      }
+    }
+
+    if (!built) {
+      order.resize(instances.size());
+      for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = (unsigned)i;
+      }
+
+      nodes.clear();
+      if (!instances.empty()) {
+        nodes.emplace_back();
+        build(0, 0, (unsigned)order.size());
+      }
+      // visible() never has more nodes pending than the tree has
+      stack.reserve(nodes.size());
+      built = true;
+    } else if (moved && !nodes.empty()) {
+      refit(0);
+    }
+  }
+
+  // Splits order[first, first + count) at the median center of its longer
+  // axis
+  void build(unsigned index, unsigned first, unsigned count) const {
+    screen_box box = boxes[order[first]];
+    screen_box centers;
+    for (unsigned i = first; i < first + count; ++i) {
+      const auto &b = boxes[order[i]];
+      screen_box center;
+      center.x0 = center.x1 = (b.x0 + b.x1) / 2;
+      center.y0 = center.y1 = (b.y0 + b.y1) / 2;
+      box.grow(b);
+      if (i == first) {
+        centers = center;
+      } else {
+        centers.grow(center);
+      }
+    }
+    nodes[index].box = box;
+
+    if (count <= LEAF_SIZE) {
+      nodes[index].first = first;
+      nodes[index].count = count;
+      return;
+    }
+
+    bool along_x = centers.x1 - centers.x0 >= centers.y1 - centers.y0;
+    auto middle = order.begin() + first + count / 2;
+    std::nth_element(order.begin() + first, middle,
+                     order.begin() + first + count, [&](unsigned a, unsigned b) {
+                       return along_x ? boxes[a].x0 + boxes[a].x1 <
+                                            boxes[b].x0 + boxes[b].x1
+                                      : boxes[a].y0 + boxes[a].y1 <
+                                            boxes[b].y0 + boxes[b].y1;
+                     });
+
+    unsigned child = (unsigned)nodes.size();
+    nodes[index].first = child;
+    nodes[index].count = 0;
+    nodes.emplace_back();
+    nodes.emplace_back();
+    build(child, first, count / 2);
+    build(child + 1, first + count / 2, count - count / 2);
+  }
+
+  screen_box refit(unsigned index) const {
+    auto &node = nodes[index];
+
+    if (node.count > 0) {
+      node.box = boxes[order[node.first]];
+      for (unsigned i = node.first + 1; i < node.first + node.count; ++i) {
+        node.box.grow(boxes[order[i]]);
+      }
+    } else {
+      node.box = refit(node.first);
+      node.box.grow(refit(node.first + 1));
+    }
+
+    return node.box;
+  }
+
+  std::deque<Instance> instances; // References stay valid on add()
+
+  mutable std::vector<screen_box> boxes;
+  mutable std::vector<uint64_t> revisions; // Of the node when boxed
+  mutable std::vector<unsigned> order;     // Instance indices, leaf ordered
+  mutable std::vector<bvh_node> nodes;
+  mutable std::vector<unsigned> stack; // Of visible()
+  mutable bool built = false;
+};
+
+// Renders every instance of the scene that is on screen into the target.
+// All of them share its depth buffer and `light`, if any. Returns how many
+// instances were drawn
+size_t draw_scene(RenderTarget &target, const Scene &scene,
+                  const Light *light = nullptr) {
+  PROFILE_SCOPE("Drawing scene");
+
+  clear_target(target, cv::Rect(0, 0, WIDTH, HEIGHT));
+  target.region = redraw_region();
+
+  screen_box screen;
+  screen.x1 = WIDTH;
+  screen.y1 = HEIGHT;
+  scene.visible(screen, target.visible);
+
+  for (auto index : target.visible) {
+    const auto &instance = scene.at(index);
+    const auto &shape = instance.get_shape();
+
+    transform_shape(shape, instance.get_matx(), target.voxels,
+                    light ? instance.get_shades(*light) : nullptr);
+    splat_target(target, shape.get_color_lut());
+  }
+
+  if (VERBOSITY >= 4) {
+    std::cout << "Drew " << target.visible.size() << " of " << scene.size()
+              << " instances" << '\n';
+  }
+
+  return target.visible.size();
+}
+
+#ifndef HEADLESS
+size_t render_scene(RenderTarget &target, const Scene &scene,
+                    const Light *light = nullptr) {
+  size_t drawn = draw_scene(target, scene, light);
+  cv::imshow(MAIN_WINDOW_NAME, target.image);
+  return drawn;
+}
+#endif
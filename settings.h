@@ -8,6 +8,10 @@ extern const bool TIME_MEASURE = true;
 extern const float INTENSITY = 15.f;
 extern const int WIDTH = 800;
 extern const int HEIGHT = 600;
+extern const int RENDER_THREADS = 0; // 0 - One per hardware thread, 1 - Serial
+extern const bool RENDER_SPANS = false; // Expand x runs instead of points
+// 0 - Multiply every voxel, 1 - Step along the voxel grid, 2 - Fixed point
+extern const int RENDER_STEPPING = 0;
 extern double ASPECT_RATIO = (double)WIDTH / HEIGHT;
 extern const char *MAIN_WINDOW_NAME = "Render";
 extern const cv::Vec3b BACKGROUND_COLOR = cv::Vec3b(0, 0, 0);
@@ -0,0 +1,144 @@
+#pragma once
+
+#include "includes.h"
+#include "node.h"
+#include "profiler.h"
+#include "settings.h"
+#include "utils.h"
+
+#include <chrono>
+#include <set>
+#include <sstream>
+#include <sys/stat.h>
+#include <tuple>
+
+// Loads the models of a scene, several files at once on a pool of threads.
+// Loaded shapes are kept and handed out again for as long as their file
+// keeps its modification time, so opening a file twice parses it once.
+// Shapes are shared and immutable, every user moves its own Instance.
+//
+// One thread at a time may call load(), the pool only runs the parsing
+class shape_loader {
+public:
+  // `threads` includes the caller of load()
+  explicit shape_loader(int threads = (int)std::thread::hardware_concurrency())
+      : pool(std::max(1, threads)) {}
+
+  std::shared_ptr<const Shape> load(const std::string &path,
+                                    const color_pairs &colors = {{'0', 360}}) {
+    return load(std::vector<std::string>{path}, colors)[0];
+  }
+
+  // One shape per path, in order. Files missing from the cache are parsed
+  // in parallel, each once however often it is listed
+  std::vector<std::shared_ptr<const Shape>>
+  load(const std::vector<std::string> &paths,
+       const color_pairs &colors = {{'0', 360}}) {
+    PROFILE_SCOPE("Loading shapes");
+    const auto start = clock::now();
+
+    // Every path is looked at once, so all of its listings get one key even
+    // if the file changes meanwhile
+    std::map<std::string, int64_t> stamps;
+    std::vector<key> keys;
+    std::set<key> pending;
+    std::vector<size_t> missing; // First path of every key not cached
+    for (size_t i = 0; i < paths.size(); ++i) {
+      auto stamp = stamps.find(paths[i]);
+      if (stamp == stamps.end()) {
+        stamp = stamps.emplace(paths[i], modified(paths[i])).first;
+      }
+      keys.push_back(key{paths[i], stamp->second, colors});
+      if (!cache.count(keys[i]) && pending.insert(keys[i]).second) {
+        missing.push_back(i);
+      }
+    }
+
+    // Shapes report their loading into a log each, printed from here in
+    // order rather than interleaved by the threads
+    std::vector<std::shared_ptr<const Shape>> loaded(missing.size());
+    std::vector<std::ostringstream> logs(missing.size());
+    std::vector<double> took(missing.size());
+    if (!missing.empty()) {
+      pool.run((int)missing.size(), [&](int m) {
+        const auto begin = clock::now();
+        loaded[m] = std::make_shared<const Shape>(paths[missing[m]].c_str(),
+                                                  colors, logs[m]);
+        took[m] = elapsed_ms(begin);
+      });
+    }
+
+    for (size_t m = 0; m < missing.size(); ++m) {
+      const key &added = keys[missing[m]];
+      forget_older(added);
+      cache[added] = loaded[m];
+
+      std::cout << logs[m].str();
+      if (VERBOSITY >= 2) {
+        std::cout << "Loaded " << added.path << " in " << took[m] << "ms"
+                  << '\n';
+      }
+    }
+
+    std::vector<std::shared_ptr<const Shape>> res;
+    for (const auto &k : keys) {
+      res.push_back(cache[k]);
+    }
+
+    if (VERBOSITY >= 2) {
+      std::cout << "Loaded " << paths.size() << " shapes, " << missing.size()
+                << " parsed, in " << elapsed_ms(start) << "ms on "
+                << pool.size() << " threads" << '\n';
+    }
+    return res;
+  }
+
+  // Drops every kept shape, the ones handed out stay valid
+  void clear() { cache.clear(); }
+  size_t size() const { return cache.size(); }
+
+private:
+  typedef std::chrono::steady_clock clock;
+
+  struct key {
+    std::string path;
+    int64_t mtime;
+    color_pairs colors;
+
+    bool operator<(const key &other) const {
+      return std::tie(path, mtime, colors) <
+             std::tie(other.path, other.mtime, other.colors);
+    }
+  };
+
+  static double elapsed_ms(clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(clock::now() - since)
+        .count();
+  }
+
+  // Modification time in nanoseconds, 0 if the file is missing. Loading it
+  // then fails like a Shape does
+  static int64_t modified(const std::string &path) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+      return 0;
+    }
+    return (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+  }
+
+  // Earlier versions of a file that changed are never asked for again
+  void forget_older(const key &newer) {
+    for (auto it = cache.begin(); it != cache.end();) {
+      const key &k = it->first;
+      if (k.path == newer.path && k.colors == newer.colors &&
+          k.mtime != newer.mtime) {
+        it = cache.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  std::map<key, std::shared_ptr<const Shape>> cache;
+  utils::worker_pool pool;
+};
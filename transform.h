@@ -0,0 +1,217 @@
+#pragma once
+
+#include "includes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BATCH_X86 1
+#include <immintrin.h>
+#endif
+
+// Batch vertex transform over struct-of-arrays voxel coordinates. Every
+// voxel (x, y, z, 1) is multiplied by a 4x4 matrix and divided by w,
+// producing screen x/y and depth arrays.
+//
+// The SIMD kernels use separate multiplies and adds in the same order as
+// cv::Matx44f * cv::Vec4f, so every ISA gives bit-identical results.
+namespace batch {
+
+enum Isa { Scalar, SSE2, AVX2 };
+
+const char *isa_name(Isa isa) {
+  switch (isa) {
+  case Isa::SSE2:
+    return "sse2";
+  case Isa::AVX2:
+    return "avx2";
+  default:
+    return "scalar";
+  }
+}
+
+bool isa_supported(Isa isa) {
+#if BATCH_X86
+  switch (isa) {
+  case Isa::AVX2:
+    return __builtin_cpu_supports("avx2");
+  case Isa::SSE2:
+    return __builtin_cpu_supports("sse2");
+  default:
+    return true;
+  }
+#else
+  return isa == Isa::Scalar;
+#endif
+}
+
+Isa best_isa() {
+  static const Isa best = isa_supported(Isa::AVX2)   ? Isa::AVX2
+                          : isa_supported(Isa::SSE2) ? Isa::SSE2
+                                                     : Isa::Scalar;
+  return best;
+}
+
+void transform_scalar(const cv::Matx44f &m, const int16_t *xs,
+                      const int16_t *ys, const int16_t *zs, size_t from,
+                      size_t to, float *sx, float *sy, float *sz) {
+  for (size_t i = from; i < to; ++i) {
+    float x = xs[i], y = ys[i], z = zs[i];
+    float tx = m(0, 0) * x + m(0, 1) * y + m(0, 2) * z + m(0, 3);
+    float ty = m(1, 0) * x + m(1, 1) * y + m(1, 2) * z + m(1, 3);
+    float tz = m(2, 0) * x + m(2, 1) * y + m(2, 2) * z + m(2, 3);
+    float tw = m(3, 0) * x + m(3, 1) * y + m(3, 2) * z + m(3, 3);
+    sx[i] = tx / tw;
+    sy[i] = ty / tw;
+    sz[i] = tz / tw;
+  }
+}
+
+#if BATCH_X86
+size_t transform_sse2(const cv::Matx44f &m, const int16_t *xs,
+                      const int16_t *ys, const int16_t *zs, size_t count,
+                      float *sx, float *sy, float *sz) {
+  __m128 c[16];
+  for (int i = 0; i < 16; ++i) {
+    c[i] = _mm_set1_ps(m.val[i]);
+  }
+
+  auto load = [](const int16_t *p) {
+    __m128i v = _mm_loadl_epi64((const __m128i *)p);
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+  };
+  auto row = [&](int r, __m128 x, __m128 y, __m128 z) {
+    __m128 acc = _mm_mul_ps(c[r * 4], x);
+    acc = _mm_add_ps(acc, _mm_mul_ps(c[r * 4 + 1], y));
+    acc = _mm_add_ps(acc, _mm_mul_ps(c[r * 4 + 2], z));
+    return _mm_add_ps(acc, c[r * 4 + 3]);
+  };
+
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = load(xs + i), y = load(ys + i), z = load(zs + i);
+    __m128 w = row(3, x, y, z);
+    _mm_storeu_ps(sx + i, _mm_div_ps(row(0, x, y, z), w));
+    _mm_storeu_ps(sy + i, _mm_div_ps(row(1, x, y, z), w));
+    _mm_storeu_ps(sz + i, _mm_div_ps(row(2, x, y, z), w));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) size_t
+transform_avx2(const cv::Matx44f &m, const int16_t *xs, const int16_t *ys,
+               const int16_t *zs, size_t count, float *sx, float *sy,
+               float *sz) {
+  __m256 c[16];
+  for (int i = 0; i < 16; ++i) {
+    c[i] = _mm256_set1_ps(m.val[i]);
+  }
+
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 p[3];
+    const int16_t *src[3] = {xs + i, ys + i, zs + i};
+    for (int k = 0; k < 3; ++k) {
+      __m128i v = _mm_loadu_si128((const __m128i *)src[k]);
+      p[k] = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+    }
+
+    __m256 t[4];
+    for (int r = 0; r < 4; ++r) {
+      __m256 acc = _mm256_mul_ps(c[r * 4], p[0]);
+      acc = _mm256_add_ps(acc, _mm256_mul_ps(c[r * 4 + 1], p[1]));
+      acc = _mm256_add_ps(acc, _mm256_mul_ps(c[r * 4 + 2], p[2]));
+      t[r] = _mm256_add_ps(acc, c[r * 4 + 3]);
+    }
+
+    _mm256_storeu_ps(sx + i, _mm256_div_ps(t[0], t[3]));
+    _mm256_storeu_ps(sy + i, _mm256_div_ps(t[1], t[3]));
+    _mm256_storeu_ps(sz + i, _mm256_div_ps(t[2], t[3]));
+  }
+  return i;
+}
+#endif
+
+// Transforms `count` voxels, the tail that does not fill a vector goes
+// through the scalar loop
+void transform(const cv::Matx44f &m, const int16_t *xs, const int16_t *ys,
+               const int16_t *zs, size_t count, float *sx, float *sy,
+               float *sz, Isa isa = best_isa()) {
+  size_t done = 0;
+
+#if BATCH_X86
+  if (isa == Isa::AVX2 && isa_supported(Isa::AVX2)) {
+    done = transform_avx2(m, xs, ys, zs, count, sx, sy, sz);
+  } else if (isa != Isa::Scalar) {
+    done = transform_sse2(m, xs, ys, zs, count, sx, sy, sz);
+  }
+#endif
+
+  transform_scalar(m, xs, ys, zs, done, count, sx, sy, sz);
+}
+
+// True if w stays 1, so voxels can be stepped along the grid
+bool is_affine(const cv::Matx44f &m) {
+  return m(3, 0) == 0 && m(3, 1) == 0 && m(3, 2) == 0 && m(3, 3) == 1;
+}
+
+const int FIXED_BITS = 16; // Fraction bits of fixed point grid steps
+
+// Transforms voxels by an affine matrix without a multiply per voxel. The
+// voxels are visited in `order`, or storage order if null, which should be
+// scanline order: sorted by z, then y, then x either way. Within a row the
+// next position is the last one plus the x column of the matrix times the
+// x distance. Every new row starts from the exact product, so rounding
+// never carries from one row to the next.
+//
+// In fixed point the steps are exact, the only error is the rounding of
+// the matrix column, at most 2^-17 pixels per voxel stepped
+template <typename T, typename Load, typename Store>
+void transform_grid(const cv::Matx44f &m, const int16_t *xs,
+                    const int16_t *ys, const int16_t *zs,
+                    const unsigned *order, size_t count, float *sx,
+                    float *sy, float *sz, Load load, Store store) {
+  const T step[3] = {load(m(0, 0)), load(m(1, 0)), load(m(2, 0))};
+  T pos[3] = {0, 0, 0};
+  int last_x = 0, last_y = 0, last_z = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    size_t v = order ? order[i] : i;
+    int x = xs[v], y = ys[v], z = zs[v];
+
+    if (i == 0 || y != last_y || z != last_z) {
+      for (int k = 0; k < 3; ++k) {
+        pos[k] = load(m(k, 0) * x + m(k, 1) * y + m(k, 2) * z + m(k, 3));
+      }
+    } else {
+      const int dx = x - last_x;
+      for (int k = 0; k < 3; ++k) {
+        pos[k] += step[k] * dx;
+      }
+    }
+
+    sx[v] = store(pos[0]);
+    sy[v] = store(pos[1]);
+    sz[v] = store(pos[2]);
+    last_x = x;
+    last_y = y;
+    last_z = z;
+  }
+}
+
+void transform_grid(const cv::Matx44f &m, const int16_t *xs,
+                    const int16_t *ys, const int16_t *zs,
+                    const unsigned *order, size_t count, float *sx,
+                    float *sy, float *sz, bool fixed) {
+  if (fixed) {
+    const float one = (float)(1 << FIXED_BITS), unit = 1.0f / one;
+    transform_grid<int64_t>(
+        m, xs, ys, zs, order, count, sx, sy, sz,
+        [&](float f) { return (int64_t)std::llround((double)f * one); },
+        [&](int64_t p) { return p * unit; });
+  } else {
+    transform_grid<float>(
+        m, xs, ys, zs, order, count, sx, sy, sz, [](float f) { return f; },
+        [](float p) { return p; });
+  }
+}
+
+} // namespace batch
@@ -2,8 +2,13 @@
 
 #include "includes.h"
 #include "node.h"
+#include "profiler.h"
 #include "settings.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
 using std::to_string;
 
 namespace utils {
@@ -51,91 +56,14 @@ template <typename T> std::string curlify(const cv::Vec<T, 3> &v) {
                   to_string(v.val[2]).c_str()});
 }
 
-class Timer {
-  Timer() {}
-  ~Timer() {}
-  static int time_measure_helper_1;
-  static int time_measure_helper_2;
-  static std::string command;
-  static bool started;
-
-public:
-  static void start_measure(const char *cmd) {
-    if (!TIME_MEASURE) {
-      return;
-    }
-
-    if (started) {
-      std::cout << "Err. Cannot start '" << cmd << "' because '" << command
-                << "' is already running" << '\n';
-      return;
-    }
-
-    started = true;
-    command = cmd;
-    time_measure_helper_1 = clock();
-  }
-
-  static void end_measure(bool print_result = true) {
-    if (!TIME_MEASURE) {
-      return;
-    }
-
-    if (!started) {
-      std::cout << "Err. Cannot finish time measure before start" << '\n';
-      return;
-    }
-
-    time_measure_helper_2 = clock();
-    if (print_result) {
-      auto took = (time_measure_helper_2 - time_measure_helper_1) /
-                  double(CLOCKS_PER_SEC) * 1000; // ms
-      std::string rating;
-
-      if (took < 6.0) {
-        rating = "\e[96mLIGHTNING FAST\e[39m";
-      } else if (took >= 6.0 && took < 30.0) {
-        rating = "\e[92mFAST\e[39m";
-      } else if (took >= 30.0 && took < 100.0) {
-        rating = "\e[93mMODERATE\e[39m";
-      } else if (took >= 100.0 && took < 160.0) {
-        rating = "\e[95mSLOW\e[39m";
-      } else if (took >= 160.0 && took < 250.0) {
-        rating = "\e[91mVERY SLOW\e[39m";
-      } else {
-        rating = "\e[31mBLOCKING\e[39m";
-      }
-
-      std::cout << "\n\t\e[32mTIME:\e[39m Execution of '" << command
-                << "' took " << took << "ms. (" << rating << ")"
-                << "\n\n";
-    }
-
-    time_measure_helper_1 = 0;
-    time_measure_helper_2 = 0;
-    command = "";
-    started = false;
-  }
-};
-int Timer::time_measure_helper_1 = 0;
-int Timer::time_measure_helper_2 = 0;
-std::string Timer::command = "";
-bool Timer::started = false;
 /*
 
 
 
 */
-cv::Matx44f &set_at(cv::Matx44f &matx, const int row, const int column,
-                    const float val) {
-  auto tmp_mat = cv::Mat2f(matx);
-  tmp_mat.at<float>(row, column) = val;
-  matx = cv::Matx44f((float *)tmp_mat.clone().ptr());
-}
-
-float get_at(const cv::Matx44f &matx, const int row, const int column) {
-  auto tmp_mat = cv::Mat2f(matx);
-  return tmp_mat.at<float>(row, column);
+// Matrix builders fill the fixed-size matrix directly, nothing is allocated
+inline float get_at(const cv::Matx44f &matx, const int row, const int column) {
+  return matx(row, column);
 }
 template <typename T> T get_at(const cv::Vec<T, 2> &v, const unsigned row) {
   return v.val[row];
@@ -144,82 +72,150 @@ template <typename T> T get_at(const cv::Vec<T, 3> &v, const unsigned row) {
   return v.val[row];
 }
 
-cv::Matx44f translate(const float x, const float y, const float z) {
-  auto matx = cv::Matx44f::eye();
-  set_at(matx, 0, 3, x);
-  set_at(matx, 1, 3, y);
-  set_at(matx, 2, 3, z);
-  return matx;
+inline cv::Matx44f translate(const float x, const float y, const float z) {
+  return cv::Matx44f(1, 0, 0, x, //
+                     0, 1, 0, y, //
+                     0, 0, 1, z, //
+                     0, 0, 0, 1);
+}
+inline cv::Matx44f translate(const cv::Point3f &p) {
+  return translate(p.x, p.y, p.z);
 }
-cv::Matx44f translate(const cv::Point3f &p) { return translate(p.x, p.y, p.z); }
 template <typename T> cv::Matx44f translate(const cv::Vec<T, 3> &p) {
   return translate(p.val[0], p.val[1], p.val[2]);
 }
 
-cv::Matx44f scale(const float x, const float y, const float z) {
-  auto matx = cv::Matx44f::eye();
-  set_at(matx, 0, 0, x);
-  set_at(matx, 1, 1, y);
-  set_at(matx, 2, 2, z);
-  return matx;
+inline cv::Matx44f scale(const float x, const float y, const float z) {
+  return cv::Matx44f(x, 0, 0, 0, //
+                     0, y, 0, 0, //
+                     0, 0, z, 0, //
+                     0, 0, 0, 1);
 }
-cv::Matx44f scale(const cv::Point3f &p) { return scale(p.x, p.y, p.z); }
+inline cv::Matx44f scale(const cv::Point3f &p) { return scale(p.x, p.y, p.z); }
 
 enum RotateAxis { X, Y, Z };
 
-cv::Matx44f rotate(const float grad, const RotateAxis axis) {
-  auto matx = cv::Matx44f::eye();
+inline cv::Matx44f rotate(const float grad, const RotateAxis axis) {
   const float rad = grad * M_PI / 180.0f;
+  const float c = std::cos(rad), s = std::sin(rad);
 
   switch (axis) {
   case RotateAxis::X:
-    set_at(matx, 1, 1, cos(rad));
-    set_at(matx, 1, 2, -sin(rad));
-    set_at(matx, 2, 1, sin(rad));
-    set_at(matx, 2, 2, cos(rad));
-    break;
-
+    return cv::Matx44f(1, 0, 0, 0, //
+                       0, c, -s, 0, //
+                       0, s, c, 0,  //
+                       0, 0, 0, 1);
   case RotateAxis::Y:
-    set_at(matx, 0, 0, cos(rad));
-    set_at(matx, 0, 2, sin(rad));
-    set_at(matx, 2, 0, -sin(rad));
-    set_at(matx, 2, 2, cos(rad));
-    break;
-
-  case RotateAxis::Z:
-    set_at(matx, 0, 0, cos(rad));
-    set_at(matx, 0, 1, -sin(rad));
-    set_at(matx, 1, 0, sin(rad));
-    set_at(matx, 1, 1, cos(rad));
-    break;
+    return cv::Matx44f(c, 0, s, 0,  //
+                       0, 1, 0, 0,  //
+                       -s, 0, c, 0, //
+                       0, 0, 0, 1);
+  default:
+    return cv::Matx44f(c, -s, 0, 0, //
+                       s, c, 0, 0,  //
+                       0, 0, 1, 0,  //
+                       0, 0, 0, 1);
   }
-
-  return matx;
 }
 
-cv::Matx44f rotate(const float grad, const cv::Vec3f vec) {
-  auto matx = cv::Matx44f::eye();
+inline cv::Matx44f rotate(const float grad, const cv::Vec3f vec) {
   const float rad = grad * M_PI / 180.0f;
 
-  auto cosval = (float)cos(rad);
-  auto sinval = (float)sin(rad);
-  auto rx = vec[0];
-  auto ry = vec[1];
-  auto rz = vec[2];
+  const float c = std::cos(rad), s = std::sin(rad), t = 1 - c;
+  const float rx = vec[0], ry = vec[1], rz = vec[2];
 
-  set_at(matx, 0, 0, cosval + pow(rx, 2.0f) * (1 - cosval));
-  set_at(matx, 0, 1, rx * ry * (1 - cosval) - rz * sinval);
-  set_at(matx, 0, 2, rx * rz * (1 - cosval) + ry * sinval);
+  return cv::Matx44f(c + rx * rx * t, rx * ry * t - rz * s,
+                     rx * rz * t + ry * s, 0, //
+                     ry * rx * t + rz * s, c + ry * ry * t,
+                     ry * rz * t - rx * s, 0, //
+                     rz * rx * t - ry * s, rz * ry * t + rx * s,
+                     c + rz * rz * t, 0, //
+                     0, 0, 0, 1);
+}
 
-  set_at(matx, 1, 0, ry * rx * (1 - cosval) + rz * sinval);
-  set_at(matx, 1, 1, cosval + pow(ry, 2.0f) * (1 - cosval));
-  set_at(matx, 1, 2, ry * rz * (1 - cosval) - rx * sinval);
+// Unit quaternion orientation
+struct quat {
+  float w, x, y, z;
 
-  set_at(matx, 2, 0, rz * rx * (1 - cosval) - ry * sinval);
-  set_at(matx, 2, 1, rz * ry * (1 - cosval) + rx * sinval);
-  set_at(matx, 2, 2, cosval + pow(rz, 2.0f) * (1 - cosval));
+  constexpr quat(float w = 1.0f, float x = 0, float y = 0, float z = 0)
+      : w(w), x(x), y(y), z(z) {}
 
-  return matx;
+  static quat from_axis_angle(const float grad, const cv::Vec3f &axis) {
+    float length = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] +
+                             axis[2] * axis[2]);
+    if (length == 0.0f) {
+      return quat();
+    }
+
+    const float half = grad * M_PI / 360.0f;
+    const float s = std::sin(half) / length;
+    return quat(std::cos(half), axis[0] * s, axis[1] * s, axis[2] * s);
+  }
+
+  constexpr quat operator*(const quat &q) const {
+    return quat(w * q.w - x * q.x - y * q.y - z * q.z,
+                w * q.x + x * q.w + y * q.z - z * q.y,
+                w * q.y - x * q.z + y * q.w + z * q.x,
+                w * q.z + x * q.y - y * q.x + z * q.w);
+  }
+
+  // Shortest arc interpolation, t from 0 (a) to 1 (b)
+  static quat slerp(const quat &a, quat b, const float t) {
+    float cosine = a.w * b.w + a.x * b.x + a.y * b.y + a.z * b.z;
+    if (cosine < 0) {
+      b = quat(-b.w, -b.x, -b.y, -b.z);
+      cosine = -cosine;
+    }
+
+    float wa = 1 - t, wb = t;
+    if (cosine < 0.9995f) { // Linear is close enough for tiny angles
+      float angle = std::acos(cosine);
+      wa = std::sin(wa * angle) / std::sin(angle);
+      wb = std::sin(wb * angle) / std::sin(angle);
+    }
+
+    return quat(wa * a.w + wb * b.w, wa * a.x + wb * b.x, wa * a.y + wb * b.y,
+                wa * a.z + wb * b.z)
+        .normalized();
+  }
+
+  quat normalized() const {
+    float length = std::sqrt(w * w + x * x + y * y + z * z);
+    return quat(w / length, x / length, y / length, z / length);
+  }
+
+  cv::Vec3f rotate(const cv::Vec3f &v) const {
+    // v + 2w(u x v) + 2u x (u x v), u being the vector part
+    cv::Vec3f u(x, y, z);
+    cv::Vec3f t = u.cross(v) * 2.0f;
+    return v + t * w + u.cross(t);
+  }
+
+  // Euler angles in degrees, rotation order X, then Y, then Z
+  cv::Vec3f to_euler() const {
+    const float deg = 180.0f / M_PI;
+    float sin_y = std::max(-1.0f, std::min(1.0f, 2 * (w * y - z * x)));
+    return cv::Vec3f(
+        std::atan2(2 * (w * x + y * z), 1 - 2 * (x * x + y * y)) * deg,
+        std::asin(sin_y) * deg,
+        std::atan2(2 * (w * z + x * y), 1 - 2 * (y * y + z * z)) * deg);
+  }
+};
+
+// translate(t) * rotation(q) * scale(s) in one pass
+inline cv::Matx44f trs(const cv::Point3f &t, const quat &q,
+                       const cv::Vec3f &s) {
+  const float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+  const float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+  const float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+  return cv::Matx44f((1 - 2 * (yy + zz)) * s[0], 2 * (xy - wz) * s[1],
+                     2 * (xz + wy) * s[2], t.x, //
+                     2 * (xy + wz) * s[0], (1 - 2 * (xx + zz)) * s[1],
+                     2 * (yz - wx) * s[2], t.y, //
+                     2 * (xz - wy) * s[0], 2 * (yz + wx) * s[1],
+                     (1 - 2 * (xx + yy)) * s[2], t.z, //
+                     0, 0, 0, 1);
 }
 
 cv::Matx44f perspective(const float fovw, const float fovh, const float znear,
@@ -247,84 +243,796 @@ std::vector<std::string> split(std::string str, std::string token) {
   return result;
 }
 
+// Whether a lazily built cache is complete, with the lock that builds it.
+// Copies take over the state, since the cache is copied along with it
+struct lazy_state {
+  std::mutex lock;
+  std::atomic<bool> built{false};
+
+  lazy_state() {}
+  lazy_state(const lazy_state &other) : built(other.built.load()) {}
+  lazy_state &operator=(const lazy_state &other) {
+    built = other.built.load();
+    return *this;
+  }
+};
+
+// Struct-of-arrays voxel store. Coordinates are packed as int16, colors are
+// indices into a small hue palette and a hashed index on the packed
+// coordinate gives O(1) membership tests.
+//
+// The arrays are either owned or attached read-only from external memory
+// (e.g. a mapped voxel file), in which case `backing` keeps that memory alive.
 class point_storage {
-  std::map<std::string, unsigned> stg;
-  std::vector<std::string> stg_vec;
-  static std::string stringify(int x, int y, int z) {
-    std::string query = to_string(x) + "," + to_string(y) + "," + to_string(z);
-    return query;
+  std::vector<int16_t> xs;
+  std::vector<int16_t> ys;
+  std::vector<int16_t> zs;
+  std::vector<uint8_t> color_ids;
+  std::vector<unsigned> palette;
+
+  std::shared_ptr<const void> backing;
+  const int16_t *ext_xs = nullptr;
+  const int16_t *ext_ys = nullptr;
+  const int16_t *ext_zs = nullptr;
+  const uint8_t *ext_color_ids = nullptr;
+  size_t ext_count = 0;
+
+  // Packed coordinate -> index, built by the first query. Shared shapes are
+  // queried from several threads at once, so only one of them builds it
+  mutable std::unordered_map<uint64_t, unsigned> lookup;
+  mutable lazy_state indexing;
+
+  static uint64_t pack(int x, int y, int z) {
+    return ((uint64_t)(uint16_t)x << 32) | ((uint64_t)(uint16_t)y << 16) |
+           (uint64_t)(uint16_t)z;
   }
-  template <typename T> static std::string stringify(const cv::Point3_<T> &p) {
-    return stringify(p.x, p.y, p.z);
+
+  const std::unordered_map<uint64_t, unsigned> &index() const {
+    if (indexing.built.load(std::memory_order_acquire)) {
+      return lookup;
+    }
+
+    std::lock_guard<std::mutex> guard(indexing.lock);
+    if (!indexing.built.load(std::memory_order_relaxed)) {
+      lookup.clear();
+      lookup.reserve(size());
+      for (size_t i = 0; i < size(); ++i) {
+        lookup.emplace(pack(get_xs()[i], get_ys()[i], get_zs()[i]),
+                       (unsigned)i);
+      }
+      indexing.built.store(true, std::memory_order_release);
+    }
+    return lookup;
   }
 
-  static cv::Point3f unstringify(std::string str) {
-    auto splitted = split(str, ",");
-    auto res = cv::Point3f(std::stof(splitted[0]), std::stof(splitted[1]),
-                           std::stof(splitted[2]));
-    return res;
+  uint8_t palette_index(unsigned color) {
+    for (size_t i = 0; i < palette.size(); ++i) {
+      if (palette[i] == color) {
+        return (uint8_t)i;
+      }
+    }
+
+    assert(palette.size() < 256);
+    palette.push_back(color);
+    return (uint8_t)(palette.size() - 1);
   }
 
 public:
   point_storage() {}
 
   explicit point_storage(std::vector<cv::Point3f> pts) {
+    reserve(pts.size());
     for (auto p = pts.begin(); p != pts.end(); ++p) {
-      std::string query = point_storage::stringify(*p);
-      stg[query] = true;
-      stg_vec.push_back(query);
+      save(*p, true);
     }
   }
 
   ~point_storage() {}
 
-  void save(float x, float y, float z, const unsigned &color) {
-    std::string query = point_storage::stringify(x, y, z);
-    stg[query] = color;
-    stg_vec.push_back(query);
+  void reserve(size_t count) {
+    xs.reserve(count);
+    ys.reserve(count);
+    zs.reserve(count);
+    color_ids.reserve(count);
+    lookup.reserve(count);
+  }
+
+  void save(int x, int y, int z, const unsigned &color) {
+    assert(!backing); // Attached storages are read-only
+
+    auto color_id = palette_index(color);
+    index(); // Make sure the lookup is complete before deduplicating
+    auto inserted = lookup.emplace(pack(x, y, z), (unsigned)xs.size());
+    if (!inserted.second) { // Already stored, only the color changes
+      color_ids[inserted.first->second] = color_id;
+      return;
+    }
+
+    xs.push_back((int16_t)x);
+    ys.push_back((int16_t)y);
+    zs.push_back((int16_t)z);
+    color_ids.push_back(color_id);
   }
 
   void save(const cv::Point3f &p, const unsigned &color) {
-    save(p.x, p.y, p.z, color);
+    save((int)p.x, (int)p.y, (int)p.z, color);
+  }
+
+  // Moves every stored voxel by the given offset
+  void shift(int dx, int dy, int dz) {
+    assert(!backing); // Attached storages are read-only
+
+    for (size_t i = 0; i < xs.size(); ++i) {
+      xs[i] = (int16_t)(xs[i] + dx);
+      ys[i] = (int16_t)(ys[i] + dy);
+      zs[i] = (int16_t)(zs[i] + dz);
+    }
+    lookup.clear(); // Rebuilt on the next query
+    indexing.built = false;
+  }
+
+  // Use external arrays in place without copying them
+  void attach(std::shared_ptr<const void> owner, const int16_t *x,
+              const int16_t *y, const int16_t *z, const uint8_t *ids,
+              size_t count, std::vector<unsigned> hues) {
+    *this = point_storage();
+    backing = std::move(owner);
+    ext_xs = x;
+    ext_ys = y;
+    ext_zs = z;
+    ext_color_ids = ids;
+    ext_count = count;
+    palette = std::move(hues);
+  }
+
+  // Owned copy of the voxels whose `keep` flag is set, sharing the palette
+  point_storage select(const std::vector<uint8_t> &keep) const {
+    point_storage res;
+    res.palette = palette;
+
+    for (size_t i = 0; i < size(); ++i) {
+      if (keep[i]) {
+        res.xs.push_back(get_xs()[i]);
+        res.ys.push_back(get_ys()[i]);
+        res.zs.push_back(get_zs()[i]);
+        res.color_ids.push_back(get_color_ids()[i]);
+      }
+    }
+
+    return res;
+  }
+
+  // Half resolution copy sharing the palette. Every occupied 2x2x2 block,
+  // aligned to even coordinates, becomes one voxel with the most common
+  // color of the block, the lowest color id on ties. `cell_of`, if given,
+  // receives the index in the copy of every voxel
+  point_storage downsample(std::vector<unsigned> *cell_of = nullptr) const {
+    std::vector<std::pair<uint64_t, unsigned>> cells(size());
+    for (size_t i = 0; i < size(); ++i) {
+      cells[i] = {pack(get_xs()[i] >> 1, get_ys()[i] >> 1, get_zs()[i] >> 1),
+                  (unsigned)i};
+    }
+    std::sort(cells.begin(), cells.end(), [&](const auto &a, const auto &b) {
+      return a.first != b.first
+                 ? a.first < b.first
+                 : get_color_ids()[a.second] < get_color_ids()[b.second];
+    });
+
+    point_storage res;
+    res.palette = palette;
+
+    for (size_t from = 0, to; from < cells.size(); from = to) {
+      uint8_t best = 0;
+      size_t best_count = 0;
+
+      auto same_cell = [&](size_t at) {
+        return at < cells.size() && cells[at].first == cells[from].first;
+      };
+
+      for (to = from; same_cell(to);) {
+        uint8_t id = get_color_ids()[cells[to].second];
+        size_t run = to;
+        while (same_cell(to) && get_color_ids()[cells[to].second] == id) {
+          ++to;
+        }
+        if (to - run > best_count) {
+          best = id;
+          best_count = to - run;
+        }
+      }
+
+      if (cell_of) {
+        cell_of->resize(size());
+        for (size_t k = from; k < to; ++k) {
+          (*cell_of)[cells[k].second] = (unsigned)res.xs.size();
+        }
+      }
+
+      unsigned i = cells[from].second;
+      res.xs.push_back(get_xs()[i] >> 1);
+      res.ys.push_back(get_ys()[i] >> 1);
+      res.zs.push_back(get_zs()[i] >> 1);
+      res.color_ids.push_back(best);
+    }
+
+    return res;
   }
 
-  bool has(float x, float y, float z) const {
-    std::string query = point_storage::stringify(x, y, z);
-    auto tmp = stg.find(query);
-    return tmp != stg.end();
+  bool has(int x, int y, int z) const {
+    const auto &idx = index();
+    return idx.find(pack(x, y, z)) != idx.end();
   }
 
-  cv::Point3f get(float x, float y, float z) const {
-    std::string query = point_storage::stringify(x, y, z);
-    auto point_raw = stg.find(query)->first;
-    return point_storage::unstringify(point_raw);
+  cv::Point3f get(int x, int y, int z) const {
+    return get((int)index().find(pack(x, y, z))->second);
   }
 
   cv::Point3f get(int index) const {
-    return point_storage::unstringify(stg_vec[index]);
+    return cv::Point3f(get_xs()[index], get_ys()[index], get_zs()[index]);
   }
 
-  unsigned get_color(float x, float y, float z) const {
-    auto query = point_storage::stringify(x, y, z);
-    return stg.find(query)->second;
+  unsigned get_color(int x, int y, int z) const {
+    return get_color((int)index().find(pack(x, y, z))->second);
   }
   unsigned get_color(int index) const {
-    auto query = stg_vec[index];
-    return stg.find(query)->second;
+    return palette[get_color_ids()[index]];
   }
 
   std::vector<cv::Point3f> get_all() const {
     std::vector<cv::Point3f> res;
+    res.reserve(size());
 
-    for (auto p = stg_vec.begin(); p != stg_vec.end(); ++p) {
-      res.push_back(point_storage::unstringify(*p));
+    for (size_t i = 0; i < size(); ++i) {
+      res.push_back(get((int)i));
     }
 
     return res;
   }
 
-  auto size() const { return stg.size(); }
-}; // namespace utils
+  const int16_t *get_xs() const { return backing ? ext_xs : xs.data(); }
+  const int16_t *get_ys() const { return backing ? ext_ys : ys.data(); }
+  const int16_t *get_zs() const { return backing ? ext_zs : zs.data(); }
+  const uint8_t *get_color_ids() const {
+    return backing ? ext_color_ids : color_ids.data();
+  }
+  const std::vector<unsigned> &get_palette() const { return palette; }
+
+  size_t size() const { return backing ? ext_count : xs.size(); }
+};
+
+// Run of voxels of one color and normal along x
+struct voxel_span {
+  int16_t y;
+  int16_t z;
+  int16_t x; // First voxel
+  uint16_t length;
+  uint8_t color_id;
+  uint8_t normal; // See encode_normal, 0 if the storage has no normals
+};
+
+// Voxels as runs along x, sorted by z, then y, then x. Rows of equal y and z
+// and slices of equal z are indexed, so runs can be visited with every axis
+// in either direction
+class span_storage {
+  std::vector<voxel_span> spans;
+  std::vector<unsigned> row_starts;   // First span of every row, plus end
+  std::vector<unsigned> slice_starts; // First row of every slice, plus end
+  size_t count = 0;
+
+public:
+  span_storage() {}
+
+  // `normals`, if given, holds an encoded normal for every voxel
+  explicit span_storage(const point_storage &points,
+                        const uint8_t *normals = nullptr) {
+    const auto xs = points.get_xs();
+    const auto ys = points.get_ys();
+    const auto zs = points.get_zs();
+    const auto ids = points.get_color_ids();
+
+    std::vector<unsigned> sorted(points.size());
+    for (size_t i = 0; i < sorted.size(); ++i) {
+      sorted[i] = (unsigned)i;
+    }
+    std::sort(sorted.begin(), sorted.end(), [&](unsigned a, unsigned b) {
+      return zs[a] != zs[b] ? zs[a] < zs[b]
+             : ys[a] != ys[b] ? ys[a] < ys[b]
+                              : xs[a] < xs[b];
+    });
+
+    for (auto i : sorted) {
+      uint8_t normal = normals ? normals[i] : 0;
+      bool new_row = spans.empty() || spans.back().z != zs[i] ||
+                     spans.back().y != ys[i];
+      bool extends = !new_row &&
+                     spans.back().x + spans.back().length == xs[i] &&
+                     spans.back().color_id == ids[i] &&
+                     spans.back().normal == normal &&
+                     spans.back().length < UINT16_MAX;
+
+      if (new_row && (spans.empty() || spans.back().z != zs[i])) {
+        slice_starts.push_back((unsigned)row_starts.size());
+      }
+      if (new_row) {
+        row_starts.push_back((unsigned)spans.size());
+      }
+
+      if (extends) {
+        ++spans.back().length;
+      } else {
+        spans.push_back({ys[i], zs[i], xs[i], 1, ids[i], normal});
+      }
+    }
+
+    count = points.size();
+    slice_starts.push_back((unsigned)row_starts.size());
+    row_starts.push_back((unsigned)spans.size());
+  }
+
+  const std::vector<voxel_span> &get_spans() const { return spans; }
+  size_t slice_count() const { return slice_starts.size() - 1; }
+  // Rows [first, last) of a slice and spans [first, last) of a row
+  unsigned slice_begin(size_t slice) const { return slice_starts[slice]; }
+  unsigned slice_end(size_t slice) const { return slice_starts[slice + 1]; }
+  unsigned row_begin(size_t row) const { return row_starts[row]; }
+  unsigned row_end(size_t row) const { return row_starts[row + 1]; }
+
+  size_t size() const { return spans.size(); }
+  size_t voxel_count() const { return count; }
+  size_t memory() const {
+    return spans.size() * sizeof(voxel_span) +
+           (row_starts.size() + slice_starts.size()) * sizeof(unsigned);
+  }
+};
+
+// Voxels grouped into BRICK^3 bricks over the bounding box of a point set.
+// Only occupied bricks are stored, each with a bit per voxel and the color
+// and encoded normal of every voxel, so a ray can skip empty bricks and
+// look a hit up without hashing.
+//
+// Cell coordinates are relative to the lower corner of the box
+class brick_volume {
+public:
+  static const int BRICK = 8;
+  static const uint32_t EMPTY = UINT32_MAX;
+
+  brick_volume() {}
+
+  // `normals`, if given, holds an encoded normal for every voxel
+  brick_volume(const point_storage &points, const uint8_t *normals) {
+    if (points.size() == 0) {
+      return;
+    }
+
+    const auto xs = points.get_xs();
+    const auto ys = points.get_ys();
+    const auto zs = points.get_zs();
+    lower = upper = cv::Point3i(xs[0], ys[0], zs[0]);
+    for (size_t i = 1; i < points.size(); ++i) {
+      lower = cv::Point3i(std::min<int>(lower.x, xs[i]),
+                          std::min<int>(lower.y, ys[i]),
+                          std::min<int>(lower.z, zs[i]));
+      upper = cv::Point3i(std::max<int>(upper.x, xs[i]),
+                          std::max<int>(upper.y, ys[i]),
+                          std::max<int>(upper.z, zs[i]));
+    }
+
+    size = upper - lower + cv::Point3i(1, 1, 1);
+    bricks = cv::Point3i((size.x + BRICK - 1) / BRICK,
+                         (size.y + BRICK - 1) / BRICK,
+                         (size.z + BRICK - 1) / BRICK);
+    table.assign((size_t)bricks.x * bricks.y * bricks.z, uint32_t(EMPTY));
+
+    for (size_t i = 0; i < points.size(); ++i) {
+      int x = xs[i] - lower.x, y = ys[i] - lower.y, z = zs[i] - lower.z;
+      uint32_t &slot = table[brick_index(x / BRICK, y / BRICK, z / BRICK)];
+      if (slot == EMPTY) {
+        slot = (uint32_t)(bits.size() / BRICK);
+        bits.resize(bits.size() + BRICK, 0);
+        color_ids.resize(color_ids.size() + BRICK * BRICK * BRICK, 0);
+        encoded_normals.resize(color_ids.size(), 0);
+      }
+
+      int local = voxel_index(x % BRICK, y % BRICK, z % BRICK);
+      bits[slot * BRICK + z % BRICK] |= 1ull << (local % (BRICK * BRICK));
+      color_ids[slot * BRICK * BRICK * BRICK + local] =
+          points.get_color_ids()[i];
+      encoded_normals[slot * BRICK * BRICK * BRICK + local] =
+          normals ? normals[i] : 0;
+    }
+  }
+
+  // Smallest voxel coordinate and edge lengths in voxels and bricks
+  cv::Point3i get_lower() const { return lower; }
+  cv::Point3i get_size() const { return size; }
+  cv::Point3i get_bricks() const { return bricks; }
+
+  // Slot of the brick at brick coordinates, EMPTY if it holds no voxel
+  uint32_t brick(int bx, int by, int bz) const {
+    return table[brick_index(bx, by, bz)];
+  }
+  // Voxel of an occupied brick at volume coordinates, only the position
+  // within the brick is used
+  bool has(uint32_t slot, int x, int y, int z) const {
+    const int m = BRICK - 1;
+    return bits[slot * BRICK + (z & m)] >> ((x & m) + (y & m) * BRICK) & 1;
+  }
+  // Local coordinates 0 to BRICK - 1 within an occupied brick
+  uint8_t color_id(uint32_t slot, int x, int y, int z) const {
+    return color_ids[slot * BRICK * BRICK * BRICK + voxel_index(x, y, z)];
+  }
+  uint8_t normal(uint32_t slot, int x, int y, int z) const {
+    return encoded_normals[slot * BRICK * BRICK * BRICK +
+                           voxel_index(x, y, z)];
+  }
+
+  size_t brick_count() const { return bits.size() / BRICK; }
+  size_t memory() const {
+    return table.size() * sizeof(uint32_t) + bits.size() * sizeof(uint64_t) +
+           color_ids.size() + encoded_normals.size();
+  }
+
+private:
+  size_t brick_index(int bx, int by, int bz) const {
+    return ((size_t)bz * bricks.y + by) * bricks.x + bx;
+  }
+  static int voxel_index(int x, int y, int z) {
+    return (z * BRICK + y) * BRICK + x;
+  }
+
+  cv::Point3i lower, upper, size, bricks;
+  std::vector<uint32_t> table;  // Brick coordinates -> slot
+  std::vector<uint64_t> bits;   // BRICK words per slot, one per z layer
+  std::vector<uint8_t> color_ids;
+  std::vector<uint8_t> encoded_normals;
+};
+
+// Occupancy of a box of voxels, one bit each. Rows along x are packed into
+// 64-bit words, so runs of voxels are tested, masked and counted a word at
+// a time. A coarse copy holds one bit per BRICK^3 block for rays to skip
+// empty space, see cast_ray()
+class occupancy_volume {
+public:
+  static const int BRICK = 4;
+  static const uint32_t EMPTY = UINT32_MAX;
+
+  occupancy_volume() : words(1, 0) {}
+
+  // The voxels of `points` inside the box from `lower` with edge lengths
+  // `size`, the rest are left out
+  occupancy_volume(const point_storage &points, cv::Point3i lower,
+                   cv::Point3i size)
+      : lower(lower), size(size), row_words((size.x + 63) / 64) {
+    words.assign(std::max<size_t>(1, (size_t)row_words * size.y * size.z),
+                 0);
+
+    const auto xs = points.get_xs();
+    const auto ys = points.get_ys();
+    const auto zs = points.get_zs();
+    for (size_t i = 0; i < points.size(); ++i) {
+      int x = xs[i] - lower.x, y = ys[i] - lower.y, z = zs[i] - lower.z;
+      if (inside(x, y, z)) {
+        words[row(y, z) + (x >> 6)] |= 1ull << (x & 63);
+      }
+    }
+
+    build_blocks();
+  }
+
+  cv::Point3i get_lower() const { return lower; }
+  cv::Point3i get_size() const { return size; }
+
+  // Voxel at model coordinates, empty outside of the box
+  bool has(int x, int y, int z) const {
+    x -= lower.x;
+    y -= lower.y;
+    z -= lower.z;
+    const bool in = inside(x, y, z);
+    const uint64_t word = words[in ? row(y, z) + (x >> 6) : 0];
+    return in & (word >> (x & 63) & 1);
+  }
+
+  // Membership of `count` points: bit i % 64 of hits[i / 64] is set if
+  // point i is. Returns how many are. When the points of a result word step
+  // by one along x in one row, like the rows of a model, their answers are
+  // the row's bits, shifted out of at most two words. Other points are
+  // tested one bit at a time
+  size_t has(const int16_t *xs, const int16_t *ys, const int16_t *zs,
+             size_t count, uint64_t *hits) const {
+    size_t found = 0;
+    for (size_t from = 0; from < count; from += 64) {
+      const size_t n = std::min<size_t>(64, count - from);
+      uint64_t word = 0;
+      if (!row_bits(xs + from, ys + from, zs + from, n, word)) {
+        for (size_t b = 0; b < n; ++b) {
+          word |= (uint64_t)has(xs[from + b], ys[from + b], zs[from + b])
+                  << b;
+        }
+      }
+      hits[from / 64] = word;
+      found += __builtin_popcountll(word);
+    }
+    return found;
+  }
+
+  // Set voxels in the box from `from` to `to`, both inclusive, in model
+  // coordinates. Whole words inside a row are counted at once, the ends
+  // are masked
+  size_t count(cv::Point3i from, cv::Point3i to) const {
+    from = cv::Point3i(std::max(from.x - lower.x, 0),
+                       std::max(from.y - lower.y, 0),
+                       std::max(from.z - lower.z, 0));
+    to = cv::Point3i(std::min(to.x - lower.x, size.x - 1),
+                     std::min(to.y - lower.y, size.y - 1),
+                     std::min(to.z - lower.z, size.z - 1));
+    if (from.x > to.x || from.y > to.y || from.z > to.z) {
+      return 0;
+    }
+
+    const int w0 = from.x >> 6, w1 = to.x >> 6;
+    const uint64_t first = ~0ull << (from.x & 63);
+    const uint64_t last = ~0ull >> (63 - (to.x & 63));
+
+    size_t total = 0;
+    for (int z = from.z; z <= to.z; ++z) {
+      for (int y = from.y; y <= to.y; ++y) {
+        const uint64_t *line = &words[row(y, z)];
+        if (w0 == w1) {
+          total += __builtin_popcountll(line[w0] & first & last);
+          continue;
+        }
+        total += __builtin_popcountll(line[w0] & first);
+        for (int w = w0 + 1; w < w1; ++w) {
+          total += __builtin_popcountll(line[w]);
+        }
+        total += __builtin_popcountll(line[w1] & last);
+      }
+    }
+    return total;
+  }
+
+  // Block at block coordinates for cast_ray(), EMPTY if it holds no voxel
+  uint32_t brick(int bx, int by, int bz) const {
+    const size_t at = ((size_t)bz * blocks.y + by) * block_words + (bx >> 6);
+    return block_bits[at] >> (bx & 63) & 1 ? 0 : EMPTY;
+  }
+  // Voxel at volume coordinates, from 0 to the size
+  bool has(uint32_t, int x, int y, int z) const {
+    return words[row(y, z) + (x >> 6)] >> (x & 63) & 1;
+  }
+
+  size_t memory() const {
+    return (words.size() + block_bits.size()) * sizeof(uint64_t);
+  }
+
+private:
+  bool inside(int x, int y, int z) const {
+    return (unsigned)x < (unsigned)size.x && (unsigned)y < (unsigned)size.y &&
+           (unsigned)z < (unsigned)size.z;
+  }
+  size_t row(int y, int z) const {
+    return ((size_t)z * size.y + y) * row_words;
+  }
+
+  // Answers of `n` points if they are x, x + 1, ... of one row, false if
+  // they are not. Bits past the end of a row are never set
+  bool row_bits(const int16_t *xs, const int16_t *ys, const int16_t *zs,
+                size_t n, uint64_t &res) const {
+    if (n < 2 || xs[1] != xs[0] + 1) {
+      return false;
+    }
+    const int x = xs[0] - lower.x, y = ys[0] - lower.y, z = zs[0] - lower.z;
+    if (x < 0 || x + (int)n > row_words * 64 || !inside(0, y, z)) {
+      return false;
+    }
+
+    bool along = true;
+    for (size_t k = 1; k < n; ++k) {
+      along &= xs[k] == xs[0] + (int)k && ys[k] == ys[0] && zs[k] == zs[0];
+    }
+    if (!along) {
+      return false;
+    }
+
+    const uint64_t *line = &words[row(y, z) + (x >> 6)];
+    const int shift = x & 63;
+    res = line[0] >> shift;
+    if (shift && shift + (int)n > 64) {
+      res |= line[1] << (64 - shift);
+    }
+    if (n < 64) {
+      res &= (1ull << n) - 1;
+    }
+    return true;
+  }
+
+  // The rows of every BRICK x BRICK group of rows are ORed word by word,
+  // then each block of BRICK bits along x folds into one
+  void build_blocks() {
+    blocks = cv::Point3i((size.x + BRICK - 1) / BRICK,
+                         (size.y + BRICK - 1) / BRICK,
+                         (size.z + BRICK - 1) / BRICK);
+    block_words = (blocks.x + 63) / 64;
+    block_bits.assign((size_t)block_words * blocks.y * blocks.z, 0);
+
+    std::vector<uint64_t> merged(row_words);
+    for (int bz = 0; bz < blocks.z; ++bz) {
+      for (int by = 0; by < blocks.y; ++by) {
+        std::fill(merged.begin(), merged.end(), 0);
+        const int z_end = std::min(size.z, (bz + 1) * BRICK);
+        const int y_end = std::min(size.y, (by + 1) * BRICK);
+        for (int z = bz * BRICK; z < z_end; ++z) {
+          for (int y = by * BRICK; y < y_end; ++y) {
+            const uint64_t *line = &words[row(y, z)];
+            for (int w = 0; w < row_words; ++w) {
+              merged[w] |= line[w];
+            }
+          }
+        }
+
+        uint64_t *out = &block_bits[((size_t)bz * blocks.y + by) * block_words];
+        for (int bx = 0; bx < blocks.x; ++bx) {
+          const int x = bx * BRICK;
+          if (merged[x >> 6] >> (x & 63) & ((1ull << BRICK) - 1)) {
+            out[bx >> 6] |= 1ull << (bx & 63);
+          }
+        }
+      }
+    }
+  }
+
+  cv::Point3i lower, size, blocks;
+  int row_words = 0;
+  int block_words = 0;
+  std::vector<uint64_t> words;      // row_words per row, rows y then z
+  std::vector<uint64_t> block_bits; // Same layout, one bit per block
+};
+
+// Inverse of an affine matrix, rows 0-2 only, the last row stays 0 0 0 1
+cv::Matx44f affine_inverse(const cv::Matx44f &m) {
+  const float det = m(0, 0) * (m(1, 1) * m(2, 2) - m(1, 2) * m(2, 1)) -
+                    m(0, 1) * (m(1, 0) * m(2, 2) - m(1, 2) * m(2, 0)) +
+                    m(0, 2) * (m(1, 0) * m(2, 1) - m(1, 1) * m(2, 0));
+  const float inv = 1.0f / det;
+
+  cv::Matx44f res = cv::Matx44f::eye();
+  for (int r = 0; r < 3; ++r) {
+    for (int c = 0; c < 3; ++c) {
+      // Cofactor of (c, r), transposed
+      int r0 = (c + 1) % 3, r1 = (c + 2) % 3, c0 = (r + 1) % 3,
+          c1 = (r + 2) % 3;
+      res(r, c) = (m(r0, c0) * m(r1, c1) - m(r0, c1) * m(r1, c0)) * inv;
+    }
+  }
+  for (int r = 0; r < 3; ++r) {
+    res(r, 3) = -(res(r, 0) * m(0, 3) + res(r, 1) * m(1, 3) +
+                  res(r, 2) * m(2, 3));
+  }
+  return res;
+}
+
+// A ray through the brick grid, in cell coordinates where voxel cell c
+// covers [c, c + 1) on every axis. `dir` points away from the viewer, the
+// screen depth at parameter s is -s
+struct grid_ray {
+  cv::Vec3f origin;
+  cv::Vec3f dir;
+};
+
+// First voxel along the ray, false if it hits none. Returns the brick slot,
+// the cell and the ray parameter where it enters that cell. Volume is a
+// brick_volume or an occupancy_volume, anything with bricks of BRICK^3
+// cells that are EMPTY or hold voxels tested by has(slot, x, y, z)
+template <class Volume>
+bool cast_ray(const Volume &volume, const grid_ray &ray, uint32_t &slot,
+              cv::Vec3i &cell, float &hit_s) {
+  const int B = Volume::BRICK;
+  const auto size = volume.get_size();
+  const int dims[3] = {size.x, size.y, size.z};
+
+  // Clip to the box of the volume
+  float enter = -1e30f, exit = 1e30f;
+  for (int k = 0; k < 3; ++k) {
+    if (ray.dir[k] == 0) {
+      if (ray.origin[k] < 0 || ray.origin[k] >= dims[k]) {
+        return false;
+      }
+      continue;
+    }
+    float a = -ray.origin[k] / ray.dir[k];
+    float b = (dims[k] - ray.origin[k]) / ray.dir[k];
+    enter = std::max(enter, std::min(a, b));
+    exit = std::min(exit, std::max(a, b));
+  }
+  if (enter >= exit) {
+    return false;
+  }
+
+  int step[3];
+  float delta[3];
+  for (int k = 0; k < 3; ++k) {
+    step[k] = ray.dir[k] > 0 ? 1 : -1;
+    delta[k] = ray.dir[k] != 0 ? std::abs(1.0f / ray.dir[k]) : 1e30f;
+  }
+
+  // Parameter where the ray leaves the box starting at `lo` with edge
+  // `edge` along axis k
+  auto leave = [&](int k, int lo, int edge) {
+    if (ray.dir[k] == 0) {
+      return 1e30f;
+    }
+    float bound = ray.dir[k] > 0 ? lo + edge : lo;
+    return (bound - ray.origin[k]) / ray.dir[k];
+  };
+
+  // Cell at parameter s, kept within [lo, hi] on every axis against
+  // rounding at the boundaries
+  int c[3];
+  auto locate = [&](float s, const int *lo, const int *hi) {
+    for (int k = 0; k < 3; ++k) {
+      int at = (int)std::floor(ray.origin[k] + ray.dir[k] * s);
+      c[k] = std::max(lo[k], std::min(hi[k], at));
+    }
+  };
+
+  float s = enter;
+  const int zero[3] = {0, 0, 0};
+  const int last[3] = {dims[0] - 1, dims[1] - 1, dims[2] - 1};
+  locate(s, zero, last);
+
+  // Cells are carried over from brick to brick rather than located again,
+  // so every step makes progress however flat the ray runs
+  while (true) {
+    const int bc[3] = {c[0] / B, c[1] / B, c[2] / B};
+    const uint32_t brick = volume.brick(bc[0], bc[1], bc[2]);
+
+    int axis;
+    if (brick == Volume::EMPTY) {
+      float out[3];
+      for (int k = 0; k < 3; ++k) {
+        out[k] = leave(k, bc[k] * B, B);
+      }
+      axis = out[0] < out[1] ? (out[0] < out[2] ? 0 : 2)
+                             : (out[1] < out[2] ? 1 : 2);
+      s = std::max(s, out[axis]);
+
+      const int lo[3] = {bc[0] * B, bc[1] * B, bc[2] * B};
+      const int hi[3] = {lo[0] + B - 1, lo[1] + B - 1, lo[2] + B - 1};
+      locate(s, lo, hi);
+      c[axis] = step[axis] > 0 ? hi[axis] + 1 : lo[axis] - 1;
+    } else {
+      float next[3];
+      for (int k = 0; k < 3; ++k) {
+        next[k] = leave(k, c[k], 1);
+      }
+
+      while (true) {
+        if (volume.has(brick, c[0], c[1], c[2])) {
+          slot = brick;
+          cell = cv::Vec3i(c[0], c[1], c[2]);
+          hit_s = s;
+          return true;
+        }
+
+        axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2)
+                                 : (next[1] < next[2] ? 1 : 2);
+        s = std::max(s, next[axis]);
+        c[axis] += step[axis];
+        next[axis] += delta[axis];
+
+        // Bricks on the far sides can reach past the volume, a cell there
+        // is never tested
+        if (c[axis] < 0 || c[axis] >= dims[axis] || c[axis] / B != bc[axis]) {
+          break; // On to the next brick, or out
+        }
+      }
+    }
+
+    if (s >= exit || c[axis] < 0 || c[axis] >= dims[axis]) {
+      return false;
+    }
+  }
+}
 
 template <class T, class Compare>
 constexpr const T &clamp(const T &v, const T &lo, const T &hi, Compare comp) {
@@ -343,6 +1051,75 @@ cv::Vec3b HSVtoBGR(const cv::Vec3f &hsv) {
   return bgrMat(0);
 }
 
+// Unit normals packed into one byte: the octahedral projection of the
+// direction on a 16x16 grid, u in the high and v in the low four bits
+inline uint8_t encode_normal(cv::Vec3f n) {
+  float sum = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+  if (sum == 0) {
+    n = cv::Vec3f(0, 0, 1.0f);
+    sum = 1.0f;
+  }
+
+  float u = n[0] / sum, v = n[1] / sum;
+  if (n[2] < 0) { // Fold the lower half over the diagonals
+    float fu = (1 - std::abs(v)) * (u < 0 ? -1 : 1);
+    float fv = (1 - std::abs(u)) * (v < 0 ? -1 : 1);
+    u = fu;
+    v = fv;
+  }
+
+  auto quantize = [](float c) {
+    return std::max(0, std::min(15, (int)std::lround((c * 0.5f + 0.5f) * 15)));
+  };
+  return (uint8_t)(quantize(u) << 4 | quantize(v));
+}
+
+inline cv::Vec3f decode_normal(uint8_t code) {
+  float u = (code >> 4) / 15.0f * 2 - 1, v = (code & 15) / 15.0f * 2 - 1;
+  float z = 1 - std::abs(u) - std::abs(v);
+  if (z < 0) {
+    float fu = (1 - std::abs(v)) * (u < 0 ? -1 : 1);
+    float fv = (1 - std::abs(u)) * (v < 0 ? -1 : 1);
+    u = fu;
+    v = fv;
+  }
+
+  cv::Vec3f n(u, v, z);
+  return n * (1.0f / std::sqrt(n.dot(n)));
+}
+
+// Prebuilt BGR colors for every palette hue at a fixed number of intensity
+// levels, so no color conversion happens per pixel
+class color_lut {
+public:
+  static const int LEVELS = 32;
+
+  color_lut() {}
+
+  explicit color_lut(const std::vector<unsigned> &hues) {
+    colors.reserve(hues.size() * LEVELS);
+    for (auto hue : hues) {
+      for (int level = 0; level < LEVELS; ++level) {
+        // Float HSV values run from 0 to 1, the saturation stays as the
+        // palette always had it so full intensity keeps its colors
+        float intensity = level / float(LEVELS - 1);
+        colors.push_back(HSVtoBGR(cv::Vec3f(hue, 100, intensity)));
+      }
+    }
+  }
+
+  const cv::Vec3b &at(int color_id, float intensity = 1.0f) const {
+    int level = (int)(intensity * (LEVELS - 1) + 0.5f);
+    level = level < 0 ? 0 : level >= LEVELS ? LEVELS - 1 : level;
+    return colors[color_id * LEVELS + level];
+  }
+
+  size_t size() const { return colors.size() / LEVELS; }
+
+private:
+  std::vector<cv::Vec3b> colors;
+};
+
 template <typename T> T clamp(T x, T min, T max) {
   if (x < min) {
     return min;
@@ -352,12 +1129,105 @@ template <typename T> T clamp(T x, T min, T max) {
   return x;
 }
 
+// Threads kept across repeated parallel loops. run() starts no thread and
+// allocates nothing, the job is handed over as a pointer
+class worker_pool {
+public:
+  // `threads` includes the caller of run()
+  explicit worker_pool(int threads) {
+    for (int t = 1; t < threads; ++t) {
+      workers.emplace_back([this]() { work(); });
+    }
+  }
+
+  ~worker_pool() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    started.notify_all();
+
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  worker_pool(const worker_pool &) = delete;
+  worker_pool &operator=(const worker_pool &) = delete;
+
+  int size() const { return (int)workers.size() + 1; }
+
+  // Runs fn(0) ... fn(count - 1) on every thread of the pool and returns
+  // when all calls are done
+  template <typename Fn> void run(int count, Fn fn) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      job = &fn;
+      call = [](void *job, int i) { (*(Fn *)job)(i); };
+      job_count = count;
+      next = 0;
+      busy = (int)workers.size();
+      ++generation;
+    }
+    started.notify_all();
+
+    take();
+
+    std::unique_lock<std::mutex> guard(lock);
+    finished.wait(guard, [&]() { return busy == 0; });
+    job = nullptr;
+  }
+
+private:
+  void take() {
+    PROFILE_SCOPE("Worker");
+    for (int i = next++; i < job_count; i = next++) {
+      call(job, i);
+    }
+  }
+
+  void work() {
+    uint64_t seen = 0;
+
+    while (true) {
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        started.wait(guard, [&]() { return stopping || generation != seen; });
+        if (stopping) {
+          return;
+        }
+        seen = generation;
+      }
+
+      take();
+
+      std::lock_guard<std::mutex> guard(lock);
+      if (--busy == 0) {
+        finished.notify_one();
+      }
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::mutex lock; // Guards everything below but `next`
+  std::condition_variable started;
+  std::condition_variable finished;
+  void *job = nullptr;
+  void (*call)(void *, int) = nullptr;
+  int job_count = 0;
+  std::atomic<int> next{0};
+  int busy = 0;
+  uint64_t generation = 0;
+  bool stopping = false;
+};
+
 template <typename _T> cv::Vec<_T, 4> p2v(const cv::Point3_<_T> &p) {
   return cv::Vec<_T, 4>(p.x, p.y, p.z, 1.0f);
 }
 
+// True for from <= val < to, the way pixel coordinates index a row
 template <typename T> bool in_range(T val, T from, T to) {
-  return ((val > from) && (val < to));
+  return ((val >= from) && (val < to));
 }
 
 } // namespace utils
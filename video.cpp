@@ -0,0 +1,248 @@
+#include "includes.h"
+#include "node.h"
+#include "settings.h"
+#include "utils.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <sstream>
+
+// Renders a transform path to a video file.
+// Usage: video <model> <path> <output.avi> <frames> [<symbol>=<hue>...]
+//
+// The path is either "turntable", one turn around the Y axis in the middle
+// of the screen, or a file of keyframes. Every keyframe line holds the path
+// parameter t from 0 to 1 and the pose at that point:
+//
+//   # t   x    y    z  angle  ax ay az  scale
+//   0     200  300  0  0      0  1  0   2
+//   0.5   400  300  0  180    0  1  0   3
+//   1     600  300  0  350    0  1  0   2
+//
+// The rotation is absolute, poses in between are interpolated. Frames are
+// rendered on the main thread and handed to an encoder thread through a
+// bounded queue, so rendering and encoding overlap.
+
+const int QUEUE_FRAMES = 8; // Frames rendered ahead of the encoder
+const double VIDEO_FPS = 30.0;
+
+struct keyframe {
+  float t;
+  cv::Point3f position;
+  utils::quat orientation;
+  float scale;
+};
+
+bool load_path(const char *filename, std::vector<keyframe> &path) {
+  std::ifstream file(filename);
+  if (!file) {
+    std::cout << "Cannot open " << filename << '\n';
+    return false;
+  }
+
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream values(line.substr(0, line.find('#')));
+    keyframe key;
+    float angle, ax, ay, az;
+
+    if (!(values >> key.t)) { // Blank line or comment
+      continue;
+    }
+    if (!(values >> key.position.x >> key.position.y >> key.position.z >>
+          angle >> ax >> ay >> az >> key.scale)) {
+      std::cout << "Bad keyframe '" << line << "'" << '\n';
+      return false;
+    }
+
+    key.orientation =
+        utils::quat::from_axis_angle(angle, cv::Vec3f(ax, ay, az));
+    path.push_back(key);
+  }
+
+  if (path.empty()) {
+    std::cout << "No keyframes in " << filename << '\n';
+    return false;
+  }
+
+  std::stable_sort(
+      path.begin(), path.end(),
+      [](const keyframe &a, const keyframe &b) { return a.t < b.t; });
+  return true;
+}
+
+// Keyframes every 120 degrees, slerp takes the short way between them
+std::vector<keyframe> turntable() {
+  std::vector<keyframe> path;
+  for (int i = 0; i <= 3; ++i) {
+    path.push_back({i / 3.0f, cv::Point3f(WIDTH / 2, HEIGHT / 2, 0),
+                    utils::quat::from_axis_angle(i * 120.0f,
+                                                 cv::Vec3f(0, 1.0f, 0)),
+                    3.0f});
+  }
+  return path;
+}
+
+void place_at(const std::vector<keyframe> &path, float t, Node &node) {
+  size_t next = 0;
+  while (next < path.size() && path[next].t < t) {
+    ++next;
+  }
+
+  const auto &b = path[std::min(next, path.size() - 1)];
+  const auto &a = path[next > 0 ? next - 1 : 0];
+  float f = b.t > a.t ? (t - a.t) / (b.t - a.t) : 0.0f;
+  float scale = a.scale + (b.scale - a.scale) * f;
+
+  node.place(a.position + (b.position - a.position) * f,
+             utils::quat::slerp(a.orientation, b.orientation, f),
+             cv::Vec3f(scale, scale, scale));
+}
+
+// Blocking queue of at most `capacity` frames
+class frame_queue {
+public:
+  explicit frame_queue(size_t capacity) : capacity(capacity) {}
+
+  void push(cv::Mat frame) {
+    std::unique_lock<std::mutex> guard(lock);
+    has_room.wait(guard, [&]() { return frames.size() < capacity; });
+    frames.push_back(std::move(frame));
+    has_frame.notify_one();
+  }
+
+  // False once the queue is closed and empty
+  bool pop(cv::Mat &frame) {
+    std::unique_lock<std::mutex> guard(lock);
+    has_frame.wait(guard, [&]() { return !frames.empty() || closed; });
+    if (frames.empty()) {
+      return false;
+    }
+
+    frame = std::move(frames.front());
+    frames.pop_front();
+    has_room.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> guard(lock);
+    closed = true;
+    has_frame.notify_all();
+  }
+
+private:
+  size_t capacity;
+  std::mutex lock;
+  std::condition_variable has_room;
+  std::condition_variable has_frame;
+  std::deque<cv::Mat> frames;
+  bool closed = false;
+};
+
+double since_ms(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+int main(int argc, char **argv) {
+  if (argc < 5) {
+    std::cout << "Usage: " << argv[0]
+              << " <model> <path> <output.avi> <frames> [<symbol>=<hue>...]\n"
+              << "Example: " << argv[0]
+              << " sphere.vox turntable spin.avi 120 f=360 e=200 d=100\n";
+    return 1;
+  }
+
+  int frames = std::atoi(argv[4]);
+  if (frames < 1) {
+    std::cout << "Bad frame count " << argv[4] << '\n';
+    return 1;
+  }
+
+  color_pairs colors;
+  for (int i = 5; i < argc; ++i) {
+    if (!parse_color_pair(argv[i], colors)) {
+      return 1;
+    }
+  }
+
+  std::vector<keyframe> path;
+  if (std::string(argv[2]) == "turntable") {
+    path = turntable();
+  } else if (!load_path(argv[2], path)) {
+    return 1;
+  }
+
+  Shape shape(argv[1], colors.empty() ? color_pairs{{'0', 360}} : colors);
+
+  // Motion JPEG is built into OpenCV, no external codec is needed
+  cv::VideoWriter writer(argv[3], cv::VideoWriter::fourcc('M', 'J', 'P', 'G'),
+                         VIDEO_FPS, cv::Size(WIDTH, HEIGHT));
+  if (!writer.isOpened()) {
+    std::cout << "Cannot write " << argv[3] << '\n';
+    return 1;
+  }
+
+  // Buffers go round from `spare` through rendering and `rendered` to the
+  // encoder and back, nothing is allocated per frame
+  frame_queue spare(QUEUE_FRAMES), rendered(QUEUE_FRAMES);
+  for (int i = 0; i < QUEUE_FRAMES; ++i) {
+    spare.push(cv::Mat(HEIGHT, WIDTH, CV_8UC3, (cv::Scalar)BACKGROUND_COLOR));
+  }
+
+  double encode_ms = 0;
+  std::thread encoder([&]() {
+    cv::Mat frame;
+    while (rendered.pop(frame)) {
+      auto start = std::chrono::steady_clock::now();
+      {
+        PROFILE_SCOPE("Encoding frame");
+        writer.write(frame);
+      }
+      encode_ms += since_ms(start);
+      spare.push(std::move(frame));
+    }
+  });
+
+  auto wall_start = std::chrono::steady_clock::now();
+  double render_ms = 0;
+  RenderTarget target;
+
+  for (int i = 0; i < frames; ++i) {
+    cv::Mat frame;
+    spare.pop(frame);
+
+    auto start = std::chrono::steady_clock::now();
+    place_at(path, frames > 1 ? i / (float)(frames - 1) : 0.0f, shape);
+    // The spare buffer holds some older frame, it is redrawn in full
+    target.image = frame;
+    target.region = redraw_region();
+    draw_shape(target, shape);
+    render_ms += since_ms(start);
+
+    rendered.push(std::move(frame));
+  }
+
+  rendered.close();
+  encoder.join();
+  writer.release();
+  double wall_ms = since_ms(wall_start);
+
+  std::cout << frames << " frames written to " << argv[3] << " in " << wall_ms
+            << "ms (" << frames * 1000.0 / wall_ms << " fps)" << '\n'
+            << "  render: " << render_ms << "ms, "
+            << frames * 1000.0 / render_ms << " fps" << '\n'
+            << "  encode: " << encode_ms << "ms, "
+            << frames * 1000.0 / encode_ms << " fps" << '\n';
+
+  if (TIME_MEASURE) {
+    profiler::report(std::cout);
+    profiler::write_trace("trace.json");
+  }
+
+  return 0;
+}
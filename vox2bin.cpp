@@ -0,0 +1,39 @@
+#include "includes.h"
+#include "node.h"
+#include "settings.h"
+#include "utils.h"
+#include "voxfile.h"
+
+// Converts a text .vox file into the binary format loaded by Shape.
+// Usage: vox2bin <input.vox> <output.vxb> <symbol>=<hue>...
+int main(int argc, char **argv) {
+  if (argc < 4) {
+    std::cout << "Usage: " << argv[0]
+              << " <input.vox> <output.vxb> <symbol>=<hue>...\n"
+              << "Example: " << argv[0]
+              << " sphere.vox sphere.vxb f=360 e=200 d=100\n";
+    return 1;
+  }
+
+  color_pairs colors;
+  std::map<unsigned, char> symbols;
+
+  for (int i = 3; i < argc; ++i) {
+    if (!parse_color_pair(argv[i], colors)) {
+      return 1;
+    }
+    symbols.emplace(colors[argv[i][0]], argv[i][0]);
+  }
+
+  Shape shape(argv[1], colors);
+  const auto &vertices = shape.get_vertices();
+
+  if (!voxfile::write(argv[2], vertices, shape.get_width(),
+                      shape.get_height(), shape.get_depth(), symbols)) {
+    std::cout << "Cannot write " << argv[2] << '\n';
+    return 1;
+  }
+
+  std::cout << "Wrote " << vertices.size() << " voxels to " << argv[2] << '\n';
+  return 0;
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include "includes.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Binary voxel format (.vxb). Little-endian, laid out so the record columns
+// can be used straight from a mapped file:
+//
+//   header          24 bytes
+//   palette         palette_size * 4 bytes
+//   x, y, z         voxel_count * int16 each, centered coordinates
+//   color ids       voxel_count * uint8, indices into the palette
+namespace voxfile {
+
+const char MAGIC[4] = {'V', 'X', 'B', '1'};
+const uint32_t VERSION = 1;
+
+struct header {
+  char magic[4];
+  uint32_t version;
+  uint16_t width;
+  uint16_t height;
+  uint16_t depth;
+  uint16_t palette_size;
+  uint32_t voxel_count;
+  uint32_t reserved;
+};
+static_assert(sizeof(header) == 24, "voxfile::header must stay packed");
+
+struct palette_entry {
+  char symbol; // Character used for this color group in the text format
+  uint8_t reserved;
+  uint16_t hue;
+};
+static_assert(sizeof(palette_entry) == 4,
+              "voxfile::palette_entry must stay packed");
+
+bool is_binary(const char *filename) {
+  char magic[sizeof(MAGIC)] = {};
+  std::ifstream file(filename, std::ios::binary);
+  file.read(magic, sizeof(magic));
+  return file && std::equal(magic, magic + sizeof(MAGIC), MAGIC);
+}
+
+// Read-only memory mapping of a whole file
+class mapping {
+public:
+  explicit mapping(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+      std::cout << "Cannot open " << filename << '\n';
+      exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      std::cout << "Cannot stat " << filename << '\n';
+      exit(1);
+    }
+
+    length = (size_t)st.st_size;
+    void *ptr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (ptr == MAP_FAILED) {
+      std::cout << "Cannot map " << filename << '\n';
+      exit(1);
+    }
+
+    madvise(ptr, length, MADV_WILLNEED);
+    bytes = (const uint8_t *)ptr;
+  }
+
+  ~mapping() { munmap((void *)bytes, length); }
+
+  mapping(const mapping &) = delete;
+  mapping &operator=(const mapping &) = delete;
+
+  const uint8_t *data() const { return bytes; }
+  size_t size() const { return length; }
+
+private:
+  const uint8_t *bytes;
+  size_t length;
+};
+
+// Validated view over a mapped .vxb file
+struct model {
+  std::shared_ptr<const mapping> file;
+  const header *hdr;
+  const palette_entry *palette;
+  const int16_t *xs;
+  const int16_t *ys;
+  const int16_t *zs;
+  const uint8_t *color_ids;
+};
+
+model open_model(const char *filename) {
+  model m;
+  m.file = std::make_shared<const mapping>(filename);
+
+  const uint8_t *base = m.file->data();
+  m.hdr = (const header *)base;
+
+  if (m.file->size() < sizeof(header) ||
+      !std::equal(MAGIC, MAGIC + sizeof(MAGIC), m.hdr->magic) ||
+      m.hdr->version != VERSION) {
+    std::cout << filename << " is not a voxel file of version " << VERSION
+              << '\n';
+    exit(1);
+  }
+
+  size_t count = m.hdr->voxel_count;
+  size_t expected = sizeof(header) +
+                    m.hdr->palette_size * sizeof(palette_entry) +
+                    count * (3 * sizeof(int16_t) + sizeof(uint8_t));
+  if (m.file->size() < expected) {
+    std::cout << filename << " is truncated. Expected " << expected
+              << " bytes, got " << m.file->size() << '\n';
+    exit(1);
+  }
+
+  const uint8_t *cursor = base + sizeof(header);
+  m.palette = (const palette_entry *)cursor;
+  cursor += m.hdr->palette_size * sizeof(palette_entry);
+  m.xs = (const int16_t *)cursor;
+  m.ys = m.xs + count;
+  m.zs = m.ys + count;
+  m.color_ids = (const uint8_t *)(m.zs + count);
+
+  return m;
+}
+
+// `symbols` maps each palette hue back to the text format character
+bool write(const char *filename, const utils::point_storage &vertices,
+           int width, int height, int depth,
+           const std::map<unsigned, char> &symbols) {
+  const auto &palette = vertices.get_palette();
+  const size_t count = vertices.size();
+
+  header hdr = {};
+  std::copy(MAGIC, MAGIC + sizeof(MAGIC), hdr.magic);
+  hdr.version = VERSION;
+  hdr.width = (uint16_t)width;
+  hdr.height = (uint16_t)height;
+  hdr.depth = (uint16_t)depth;
+  hdr.palette_size = (uint16_t)palette.size();
+  hdr.voxel_count = (uint32_t)count;
+
+  std::ofstream file(filename, std::ios::binary);
+  file.write((const char *)&hdr, sizeof(hdr));
+
+  for (auto hue : palette) {
+    palette_entry entry = {};
+    auto symbol = symbols.find(hue);
+    entry.symbol = symbol != symbols.end() ? symbol->second : '?';
+    entry.hue = (uint16_t)hue;
+    file.write((const char *)&entry, sizeof(entry));
+  }
+
+  file.write((const char *)vertices.get_xs(), count * sizeof(int16_t));
+  file.write((const char *)vertices.get_ys(), count * sizeof(int16_t));
+  file.write((const char *)vertices.get_zs(), count * sizeof(int16_t));
+  file.write((const char *)vertices.get_color_ids(), count * sizeof(uint8_t));
+
+  return (bool)file;
+}
+
+} // namespace voxfile
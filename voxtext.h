@@ -0,0 +1,108 @@
+#pragma once
+
+#include "includes.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Streaming parser for text .vox files. A file is a stack of slices separated
+// by blank lines, every slice is a block of rows and every non-space
+// character of a row is a voxel. Width, height and depth are the largest row
+// length, rows per slice and slice count, so volumes need not be cubic.
+//
+// The file is read in fixed-size chunks, memory use does not depend on the
+// file size.
+namespace voxtext {
+
+const size_t CHUNK_SIZE = 1 << 16;
+
+struct dims {
+  int width = 0;
+  int height = 0;
+  int depth = 0;
+};
+
+// Returns the offset of the first byte in [from, to) that is not a space.
+// Newlines end a run, they are rare next to the spaces between voxels
+size_t skip_spaces(const char *buf, size_t from, size_t to) {
+#if defined(__SSE2__)
+  const __m128i spaces = _mm_set1_epi8(' ');
+  for (; from + 16 <= to; from += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(buf + from));
+    unsigned other =
+        ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, spaces)) & 0xFFFFu;
+    if (other) {
+      return from + __builtin_ctz(other);
+    }
+  }
+#endif
+  while (from < to && buf[from] == ' ') {
+    ++from;
+  }
+  return from;
+}
+
+// Calls emit(x, y, z, ch) for every voxel with zero based, uncentered
+// coordinates. Returns false if the file cannot be read
+template <typename Emit> bool parse(const char *filename, dims &size, Emit emit) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+
+  char buf[CHUNK_SIZE];
+  size = dims();
+
+  int64_t base = 0;       // Stream offset of buf[0]
+  int64_t line_start = 0; // Stream offset of the current row
+  int y = 0, z = 0;
+  bool carriage_return = false;
+
+  auto end_row = [&](int64_t offset) {
+    int length = (int)(offset - line_start) - (carriage_return ? 1 : 0);
+    if (length == 0) { // Blank line, the slice is complete
+      if (y > 0) {
+        ++z;
+        y = 0;
+      }
+    } else {
+      size.width = std::max(size.width, length);
+      size.height = std::max(size.height, ++y);
+    }
+    line_start = offset + 1;
+    carriage_return = false;
+  };
+
+  while (file) {
+    file.read(buf, sizeof(buf));
+    size_t count = (size_t)file.gcount();
+
+    for (size_t i = skip_spaces(buf, 0, count); i < count;
+         i = skip_spaces(buf, i + 1, count)) {
+      char ch = buf[i];
+
+      if (ch == '\n') {
+        end_row(base + i);
+      } else if (ch == '\r') {
+        carriage_return = true;
+      } else {
+        emit((int)(base + i - line_start), y, z, ch);
+      }
+    }
+
+    base += count;
+  }
+
+  if (base > line_start) { // Last row without a trailing newline
+    end_row(base);
+  }
+  if (y > 0) { // Last slice without a trailing blank line
+    ++z;
+  }
+  size.depth = z;
+
+  return true;
+}
+
+} // namespace voxtext